@@ -0,0 +1,70 @@
+#include "arena.h"
+
+#ifdef TEST_SMALL_SIZE
+const size_t ARENA_BLOCK_SIZE = 4096;
+#else
+const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+#endif
+const size_t ARENA_ALIGNMENT = alignof(std::max_align_t);
+
+Arena::Arena() : current(nullptr), memory_usage(0) {}
+
+char *Arena::allocate(size_t bytes)
+{
+    bytes = (bytes + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    // Large objects get a block of their own so the rest of the current
+    // block is not wasted.
+    if (bytes > ARENA_BLOCK_SIZE / 4)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return allocate_block(bytes)->data.get();
+    }
+
+    char *result = try_allocate(current.load(std::memory_order_acquire), bytes);
+    if (result)
+    {
+        return result;
+    }
+
+    // Another writer may have started a new block while this one waited.
+    std::lock_guard<std::mutex> lock(mutex);
+    result = try_allocate(current.load(std::memory_order_acquire), bytes);
+    if (result)
+    {
+        return result;
+    }
+
+    Block *block = allocate_block(ARENA_BLOCK_SIZE);
+    block->used.store(bytes, std::memory_order_relaxed);
+    current.store(block, std::memory_order_release);
+    return block->data.get();
+}
+
+// A failed claim leaves used past the end, so the block stays full for
+// everyone after it.
+char *Arena::try_allocate(Block *block, size_t bytes)
+{
+    if (!block)
+    {
+        return nullptr;
+    }
+    size_t offset = block->used.fetch_add(bytes, std::memory_order_relaxed);
+    if (offset + bytes > block->size)
+    {
+        return nullptr;
+    }
+    return block->data.get() + offset;
+}
+
+Arena::Block *Arena::allocate_block(size_t bytes)
+{
+    blocks.push_back(std::make_unique<Block>(bytes));
+    memory_usage.fetch_add(bytes + sizeof(char *), std::memory_order_relaxed);
+    return blocks.back().get();
+}
+
+size_t Arena::get_memory_usage() const
+{
+    return memory_usage.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstddef>
+
+// Bump allocator for memtable nodes, keys and values. Nothing is freed
+// individually; all blocks go away with the arena. allocate() may be called
+// from several threads at once: it claims space in the current block with
+// one fetch_add and only locks to start a new block.
+class Arena
+{
+private:
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        size_t size;
+        std::atomic<size_t> used;
+
+        Block(size_t bytes) : data(new char[bytes]), size(bytes), used(0) {}
+    };
+
+    std::vector<std::unique_ptr<Block>> blocks;
+    std::atomic<Block *> current;
+    std::atomic<size_t> memory_usage;
+    std::mutex mutex;
+
+    static char *try_allocate(Block *block, size_t bytes);
+    Block *allocate_block(size_t bytes);
+
+public:
+    Arena();
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    char *allocate(size_t bytes);
+    size_t get_memory_usage() const;
+};
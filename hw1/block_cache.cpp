@@ -0,0 +1,136 @@
+#include "block_cache.h"
+
+BlockCache::BlockCache(size_t capacity_bytes, size_t num_shards) : shards(num_shards > 0 ? num_shards : 1)
+{
+    for (auto &shard : shards)
+    {
+        shard.capacity = capacity_bytes / shards.size();
+    }
+}
+
+BlockCache::Shard &BlockCache::shard_for(const Key &key)
+{
+    return shards[KeyHash()(key) % shards.size()];
+}
+
+std::shared_ptr<const std::string> BlockCache::lookup(uint64_t file_id, uint64_t offset)
+{
+    Key key{file_id, offset};
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end())
+    {
+        shard.stats.misses++;
+        return nullptr;
+    }
+
+    shard.stats.hits++;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->block;
+}
+
+void BlockCache::insert(uint64_t file_id, uint64_t offset, std::shared_ptr<const std::string> block, bool pinned)
+{
+    Key key{file_id, offset};
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end())
+    {
+        Entry &entry = *it->second;
+        pinned = pinned || entry.pinned;
+        shard.stats.usage -= entry.block->size();
+        if (entry.pinned)
+        {
+            shard.stats.pinned_usage -= entry.block->size();
+        }
+        shard.lru.erase(it->second);
+        shard.entries.erase(it);
+    }
+
+    shard.stats.inserts++;
+    shard.stats.usage += block->size();
+    if (pinned)
+    {
+        shard.stats.pinned_usage += block->size();
+    }
+    shard.lru.push_front({key, std::move(block), pinned});
+    shard.entries[key] = shard.lru.begin();
+
+    evict(shard);
+}
+
+void BlockCache::evict(Shard &shard)
+{
+    auto it = shard.lru.end();
+    while (shard.stats.usage > shard.capacity && it != shard.lru.begin())
+    {
+        --it;
+        if (it->pinned)
+        {
+            continue;
+        }
+
+        shard.stats.usage -= it->block->size();
+        shard.stats.evictions++;
+        shard.entries.erase(it->key);
+        it = shard.lru.erase(it);
+    }
+}
+
+void BlockCache::erase_file(uint64_t file_id)
+{
+    for (auto &shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto it = shard.lru.begin(); it != shard.lru.end();)
+        {
+            if (it->key.file_id != file_id)
+            {
+                ++it;
+                continue;
+            }
+
+            shard.stats.usage -= it->block->size();
+            if (it->pinned)
+            {
+                shard.stats.pinned_usage -= it->block->size();
+            }
+            shard.entries.erase(it->key);
+            it = shard.lru.erase(it);
+        }
+    }
+}
+
+size_t BlockCache::get_num_shards() const
+{
+    return shards.size();
+}
+
+BlockCacheStats BlockCache::get_shard_stats(size_t shard) const
+{
+    std::lock_guard<std::mutex> lock(shards[shard].mutex);
+    BlockCacheStats stats = shards[shard].stats;
+    stats.entries = shards[shard].entries.size();
+    return stats;
+}
+
+BlockCacheStats BlockCache::get_stats() const
+{
+    BlockCacheStats total;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        BlockCacheStats stats = get_shard_stats(i);
+        total.hits += stats.hits;
+        total.misses += stats.misses;
+        total.inserts += stats.inserts;
+        total.evictions += stats.evictions;
+        total.entries += stats.entries;
+        total.usage += stats.usage;
+        total.pinned_usage += stats.pinned_usage;
+    }
+    return total;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+struct BlockCacheStats
+{
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t inserts = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t usage = 0;
+    size_t pinned_usage = 0;
+};
+
+// Sharded LRU cache of uncompressed SSTable blocks keyed by
+// (file id, block offset). Capacity is in bytes and split evenly between
+// shards. Pinned blocks are charged to the capacity but never evicted;
+// they are only dropped by erase_file().
+class BlockCache
+{
+private:
+    struct Key
+    {
+        uint64_t file_id;
+        uint64_t offset;
+
+        bool operator==(const Key &other) const
+        {
+            return file_id == other.file_id && offset == other.offset;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const
+        {
+            uint64_t h = key.file_id * 0x9E3779B97F4A7C15ULL ^ key.offset;
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDULL;
+            h ^= h >> 33;
+            return static_cast<size_t>(h);
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        std::shared_ptr<const std::string> block;
+        bool pinned;
+    };
+
+    struct Shard
+    {
+        mutable std::mutex mutex;
+        std::list<Entry> lru;
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> entries;
+        size_t capacity = 0;
+        BlockCacheStats stats;
+    };
+
+    std::vector<Shard> shards;
+
+    Shard &shard_for(const Key &key);
+    static void evict(Shard &shard);
+
+public:
+    BlockCache(size_t capacity_bytes, size_t num_shards = 16);
+    std::shared_ptr<const std::string> lookup(uint64_t file_id, uint64_t offset);
+    void insert(uint64_t file_id, uint64_t offset, std::shared_ptr<const std::string> block, bool pinned = false);
+    void erase_file(uint64_t file_id);
+    size_t get_num_shards() const;
+    BlockCacheStats get_shard_stats(size_t shard) const;
+    BlockCacheStats get_stats() const;
+};
@@ -1,39 +1,222 @@
 #include "bloom_filter.h"
+#include "utils.h"
+
 #include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLOOM_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+const size_t LEGACY_BLOOM_FILTER_BITS = 1024 * 1024;
+const int LEGACY_BLOOM_NUM_HASHES = 3;
+const size_t BLOOM_MIN_BITS = 64;
+const int BLOOM_MAX_HASHES = 30;
+const size_t BLOOM_TRAILER_SIZE = 2;
+const size_t BLOOM_BLOCK_WORDS = 8;
+const size_t BLOOM_BLOCK_BITS = BLOOM_BLOCK_WORDS * 32;
+
+// Odd multipliers from the Impala/Parquet split block filter; each one
+// picks the bit to set in its word from the low 32 bits of the hash.
+alignas(32) static const uint32_t BLOOM_BLOCK_SALT[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
 
-const size_t BLOOM_FILTER_SIZE = 1024 * 1024;
+static void block_insert(uint32_t *block, uint32_t h)
+{
+    for (size_t i = 0; i < BLOOM_BLOCK_WORDS; i++)
+    {
+        block[i] |= 1u << ((h * BLOOM_BLOCK_SALT[i]) >> 27);
+    }
+}
 
-BloomFilter::BloomFilter(size_t filter_size, int hashes)
-    : size(filter_size), num_hashes(hashes)
+static bool block_check_scalar(const uint32_t *block, uint32_t h)
 {
-    bits.resize(size, false);
+    for (size_t i = 0; i < BLOOM_BLOCK_WORDS; i++)
+    {
+        if (!(block[i] & (1u << ((h * BLOOM_BLOCK_SALT[i]) >> 27))))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-size_t BloomFilter::hash(const std::string &key, int seed) const
+#ifdef BLOOM_HAVE_X86
+__attribute__((target("avx2"))) static bool block_check_avx2(const uint32_t *block, uint32_t h)
+{
+    __m256i salt = _mm256_load_si256(reinterpret_cast<const __m256i *>(BLOOM_BLOCK_SALT));
+    __m256i shifts = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(h), salt), 27);
+    __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), shifts);
+    __m256i data = _mm256_load_si256(reinterpret_cast<const __m256i *>(block));
+    return _mm256_testc_si256(data, mask);
+}
+
+__attribute__((target("sse4.1"))) static bool block_check_sse41(const uint32_t *block, uint32_t h)
+{
+    // SSE has no per-lane variable shift, so the mask is built in scalar code.
+    alignas(16) uint32_t mask[BLOOM_BLOCK_WORDS];
+    for (size_t i = 0; i < BLOOM_BLOCK_WORDS; i++)
+    {
+        mask[i] = 1u << ((h * BLOOM_BLOCK_SALT[i]) >> 27);
+    }
+    const __m128i *data = reinterpret_cast<const __m128i *>(block);
+    const __m128i *bits = reinterpret_cast<const __m128i *>(mask);
+    return _mm_testc_si128(_mm_load_si128(data), _mm_load_si128(bits)) &&
+           _mm_testc_si128(_mm_load_si128(data + 1), _mm_load_si128(bits + 1));
+}
+#endif
+
+using BlockCheckFn = bool (*)(const uint32_t *, uint32_t);
+
+struct BlockCheckImpl
+{
+    BlockCheckFn fn;
+    const char *name;
+};
+
+static BlockCheckImpl select_block_check()
+{
+#ifdef BLOOM_HAVE_X86
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return {block_check_avx2, "avx2"};
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return {block_check_sse41, "sse4.1"};
+    }
+#endif
+    return {block_check_scalar, "scalar"};
+}
+
+static const BlockCheckImpl block_check = select_block_check();
+
+BloomFilter::BloomFilter() : num_bits(0), num_hashes(0), legacy(false), type(BloomFilterType::Standard) {}
+
+BloomFilter::BloomFilter(size_t num_keys, double bits_per_key, BloomFilterType filter_type)
+    : legacy(false), type(filter_type)
+{
+    if (type == BloomFilterType::Blocked)
+    {
+        size_t wanted_bits = static_cast<size_t>(num_keys * bits_per_key);
+        blocks.assign(std::max<size_t>(1, (wanted_bits + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS), Block{});
+        num_bits = blocks.size() * BLOOM_BLOCK_BITS;
+        num_hashes = BLOOM_BLOCK_WORDS;
+        return;
+    }
+
+    num_bits = std::max<size_t>(BLOOM_MIN_BITS, static_cast<size_t>(num_keys * bits_per_key));
+    num_bits = (num_bits + 7) / 8 * 8;
+    bits.assign(num_bits / 8, 0);
+
+    // k = ln(2) * bits_per_key minimises the false positive rate.
+    num_hashes = std::clamp(static_cast<int>(std::lround(bits_per_key * 0.69)), 1, BLOOM_MAX_HASHES);
+}
+
+BloomFilter BloomFilter::create_legacy()
+{
+    BloomFilter filter;
+    filter.legacy = true;
+    filter.num_bits = LEGACY_BLOOM_FILTER_BITS;
+    filter.num_hashes = LEGACY_BLOOM_NUM_HASHES;
+    filter.bits.assign(LEGACY_BLOOM_FILTER_BITS / 8, 0);
+    return filter;
+}
+
+size_t BloomFilter::block_index(uint64_t hash) const
+{
+    // Maps the high half of the hash onto [0, blocks.size()) without a division.
+    return ((hash >> 32) * blocks.size()) >> 32;
+}
+
+const char *BloomFilter::get_simd_level()
+{
+    return block_check.name;
+}
+
+double BloomFilter::bits_per_key_for(double false_positive_rate)
+{
+    false_positive_rate = std::clamp(false_positive_rate, 1e-9, 0.5);
+    return -std::log(false_positive_rate) / (std::log(2.0) * std::log(2.0));
+}
+
+size_t BloomFilter::legacy_hash(std::string_view key, int seed) const
 {
     size_t h = 0;
     for (char c : key)
     {
         h = h * seed + c;
     }
-    return h % size;
+    return h % num_bits;
 }
 
-void BloomFilter::add(const std::string &key)
+void BloomFilter::add(std::string_view key)
 {
+    if (num_bits == 0)
+    {
+        return;
+    }
+
+    if (legacy)
+    {
+        for (int i = 0; i < num_hashes; i++)
+        {
+            size_t pos = legacy_hash(key, i + 1);
+            bits[pos / 8] |= 1 << (pos % 8);
+        }
+        return;
+    }
+
+    uint64_t h = hash64(key.data(), key.size());
+    if (type == BloomFilterType::Blocked)
+    {
+        block_insert(blocks[block_index(h)].words, static_cast<uint32_t>(h));
+        return;
+    }
+
+    uint64_t h1 = h & 0xFFFFFFFF;
+    uint64_t h2 = h >> 32;
     for (int i = 0; i < num_hashes; i++)
     {
-        size_t pos = hash(key, i + 1);
-        bits[pos] = true;
+        size_t pos = (h1 + i * h2) % num_bits;
+        bits[pos / 8] |= 1 << (pos % 8);
     }
 }
 
-bool BloomFilter::might_contain(const std::string &key) const
+bool BloomFilter::might_contain(std::string_view key) const
 {
+    if (num_bits == 0)
+    {
+        return true;
+    }
+
+    if (legacy)
+    {
+        for (int i = 0; i < num_hashes; i++)
+        {
+            size_t pos = legacy_hash(key, i + 1);
+            if (!(bits[pos / 8] & (1 << (pos % 8))))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint64_t h = hash64(key.data(), key.size());
+    if (type == BloomFilterType::Blocked)
+    {
+        return block_check.fn(blocks[block_index(h)].words, static_cast<uint32_t>(h));
+    }
+
+    uint64_t h1 = h & 0xFFFFFFFF;
+    uint64_t h2 = h >> 32;
     for (int i = 0; i < num_hashes; i++)
     {
-        size_t pos = hash(key, i + 1);
-        if (!bits[pos])
+        size_t pos = (h1 + i * h2) % num_bits;
+        if (!(bits[pos / 8] & (1 << (pos % 8))))
         {
             return false;
         }
@@ -41,31 +224,125 @@ bool BloomFilter::might_contain(const std::string &key) const
     return true;
 }
 
-std::vector<uint8_t> BloomFilter::serialize() const
+// Hashes every key and prefetches its block before probing any of them, so
+// the cache misses of a batch overlap instead of being paid one by one.
+void BloomFilter::might_contain_batch(const std::vector<std::string_view> &keys, std::vector<bool> &result) const
 {
-    std::vector<uint8_t> result;
-    for (size_t i = 0; i < size; i += 8)
+    result.assign(keys.size(), true);
+    if (type != BloomFilterType::Blocked)
     {
-        uint8_t byte = 0;
-        for (int j = 0; j < 8 && i + j < size; j++)
+        for (size_t i = 0; i < keys.size(); i++)
         {
-            if (bits[i + j])
+            result[i] = might_contain(keys[i]);
+        }
+        return;
+    }
+
+    std::vector<uint64_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        hashes[i] = hash64(keys[i].data(), keys[i].size());
+#ifdef __GNUC__
+        __builtin_prefetch(&blocks[block_index(hashes[i])]);
+#endif
+    }
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        result[i] = block_check.fn(blocks[block_index(hashes[i])].words, static_cast<uint32_t>(hashes[i]));
+    }
+}
+
+std::string BloomFilter::serialize() const
+{
+    std::string result;
+    if (type == BloomFilterType::Blocked)
+    {
+        result.reserve(blocks.size() * sizeof(Block) + BLOOM_TRAILER_SIZE);
+        for (const Block &block : blocks)
+        {
+            for (uint32_t word : block.words)
             {
-                byte |= (1 << j);
+                put_uint32(result, word);
             }
         }
-        result.push_back(byte);
+    }
+    else
+    {
+        result.assign(bits.begin(), bits.end());
+    }
+
+    if (!legacy)
+    {
+        result.push_back(static_cast<char>(num_hashes));
+        result.push_back(static_cast<char>(type));
     }
     return result;
 }
 
-void BloomFilter::deserialize(const std::vector<uint8_t> &data)
+bool BloomFilter::deserialize(std::string_view data)
 {
-    for (size_t i = 0; i < data.size(); i++)
+    if (data.size() < BLOOM_TRAILER_SIZE)
+    {
+        return false;
+    }
+
+    int hashes = static_cast<uint8_t>(data[data.size() - 2]);
+    uint8_t filter_type = static_cast<uint8_t>(data[data.size() - 1]);
+    size_t filter_size = data.size() - BLOOM_TRAILER_SIZE;
+    legacy = false;
+
+    if (filter_type == static_cast<uint8_t>(BloomFilterType::Blocked))
     {
-        for (int j = 0; j < 8 && i * 8 + j < size; j++)
+        if (hashes != BLOOM_BLOCK_WORDS || filter_size == 0 || filter_size % sizeof(Block) != 0)
         {
-            bits[i * 8 + j] = (data[i] >> j) & 1;
+            return false;
         }
+        type = BloomFilterType::Blocked;
+        blocks.resize(filter_size / sizeof(Block));
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            for (size_t j = 0; j < BLOOM_BLOCK_WORDS; j++)
+            {
+                blocks[i].words[j] = decode_uint32(data.data() + i * sizeof(Block) + j * sizeof(uint32_t));
+            }
+        }
+        bits.clear();
+        num_bits = blocks.size() * BLOOM_BLOCK_BITS;
+        num_hashes = hashes;
+        return true;
+    }
+
+    if (filter_type != static_cast<uint8_t>(BloomFilterType::Standard) || hashes < 1 || hashes > BLOOM_MAX_HASHES)
+    {
+        return false;
     }
+
+    type = BloomFilterType::Standard;
+    blocks.clear();
+    bits.assign(data.begin(), data.begin() + filter_size);
+    num_bits = bits.size() * 8;
+    num_hashes = hashes;
+    return true;
+}
+
+bool BloomFilter::deserialize_legacy(std::string_view data)
+{
+    *this = create_legacy();
+    std::copy_n(data.begin(), std::min(data.size(), bits.size()), bits.begin());
+    return true;
+}
+
+size_t BloomFilter::get_num_bits() const
+{
+    return num_bits;
+}
+
+int BloomFilter::get_num_hashes() const
+{
+    return num_hashes;
+}
+
+BloomFilterType BloomFilter::get_type() const
+{
+    return type;
 }
@@ -1,22 +1,64 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdint>
 
+const double BLOOM_DEFAULT_BITS_PER_KEY = 10.0;
+
+enum class BloomFilterType : uint8_t
+{
+    // Probe positions spread over the whole array with Kirsch-Mitzenmacher
+    // double hashing (g_i = h1 + i * h2) of one 64-bit hash.
+    Standard = 0,
+    // Split block filter: the key picks one 32-byte block and sets one bit in
+    // each of its eight 32-bit words, so a lookup touches a single cache
+    // line and is checked with one AVX2 (or SSE4.1) mask test.
+    Blocked = 1
+};
+
+// Bloom filter sized from the number of keys it will hold.
+// The serialized form is [bits][num_hashes u8][type u8].
+//
+// SSTables written before format 3 carry a legacy filter: a fixed 1M-bit
+// array probed with a polynomial hash and no trailer. create_legacy() and
+// deserialize_legacy() keep those files readable.
 class BloomFilter
 {
 private:
-    std::vector<bool> bits;
-    size_t size;
+    // 32-byte aligned, so a block never straddles a cache line.
+    struct alignas(32) Block
+    {
+        uint32_t words[8];
+    };
+
+    std::vector<uint8_t> bits;
+    std::vector<Block> blocks;
+    size_t num_bits;
     int num_hashes;
+    bool legacy;
+    BloomFilterType type;
 
-    size_t hash(const std::string &key, int seed) const;
+    size_t legacy_hash(std::string_view key, int seed) const;
+    size_t block_index(uint64_t hash) const;
 
 public:
-    BloomFilter(size_t filter_size = 1024 * 1024, int hashes = 3);
-    void add(const std::string &key);
-    bool might_contain(const std::string &key) const;
-    std::vector<uint8_t> serialize() const;
-    void deserialize(const std::vector<uint8_t> &data);
+    BloomFilter();
+    BloomFilter(size_t num_keys, double bits_per_key = BLOOM_DEFAULT_BITS_PER_KEY,
+                BloomFilterType filter_type = BloomFilterType::Standard);
+    static BloomFilter create_legacy();
+    static double bits_per_key_for(double false_positive_rate);
+    static const char *get_simd_level();
+
+    void add(std::string_view key);
+    bool might_contain(std::string_view key) const;
+    void might_contain_batch(const std::vector<std::string_view> &keys, std::vector<bool> &result) const;
+    std::string serialize() const;
+    bool deserialize(std::string_view data);
+    bool deserialize_legacy(std::string_view data);
+
+    size_t get_num_bits() const;
+    int get_num_hashes() const;
+    BloomFilterType get_type() const;
 };
@@ -0,0 +1,278 @@
+#include "compression.h"
+#include "utils.h"
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+// LZ format: [raw_size varint] then sequences of
+// [token u8][literal length extra][literals][offset u16][match length extra].
+// The token holds the literal length in its high nibble and the match length
+// minus LZ_MIN_MATCH in its low one; a nibble of 15 continues in extra bytes
+// of 255 until a smaller one. The last sequence has literals only.
+// Both codecs share the format; LZHigh searches further back for matches.
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_MAX_OFFSET = 65535;
+const int LZ_MIN_HASH_BITS = 8;
+const int LZ_MAX_HASH_BITS = 14;
+const int LZ_FAST_SEARCH_DEPTH = 1;
+const int LZ_HIGH_SEARCH_DEPTH = 64;
+
+static uint32_t lz_hash(const char *ptr, int hash_bits)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return (value * 2654435761u) >> (32 - hash_bits);
+}
+
+static void put_length(std::string &dst, size_t length)
+{
+    while (length >= 255)
+    {
+        dst.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    dst.push_back(static_cast<char>(length));
+}
+
+static bool get_length(const char *&ptr, const char *limit, size_t &length)
+{
+    uint8_t byte;
+    do
+    {
+        if (ptr >= limit)
+        {
+            return false;
+        }
+        byte = static_cast<uint8_t>(*ptr++);
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// A match_length of 0 ends the stream.
+static void put_sequence(std::string &dst, std::string_view literals, size_t offset, size_t match_length)
+{
+    size_t literal_code = std::min<size_t>(literals.size(), 15);
+    size_t match_code = match_length > 0 ? std::min<size_t>(match_length - LZ_MIN_MATCH, 15) : 0;
+    dst.push_back(static_cast<char>(literal_code << 4 | match_code));
+    if (literal_code == 15)
+    {
+        put_length(dst, literals.size() - 15);
+    }
+    dst.append(literals);
+    if (match_length == 0)
+    {
+        return;
+    }
+
+    dst.push_back(static_cast<char>(offset & 0xff));
+    dst.push_back(static_cast<char>(offset >> 8));
+    if (match_code == 15)
+    {
+        put_length(dst, match_length - LZ_MIN_MATCH - 15);
+    }
+}
+
+// Greedy parse over hash chains of 4-byte prefixes, trying up to
+// search_depth earlier positions for the longest match. The hash table has
+// about one slot per four input bytes, so setting it up costs no more than
+// the block itself, and is reused across calls on the same thread.
+static void lz_compress(std::string_view input, std::string &output, int search_depth)
+{
+    output.clear();
+    put_varint32(output, input.size());
+
+    const char *base = input.data();
+    size_t size = input.size();
+    int hash_bits = LZ_MIN_HASH_BITS;
+    while (hash_bits < LZ_MAX_HASH_BITS && (size_t(1) << hash_bits) < size / 4)
+    {
+        hash_bits++;
+    }
+    thread_local std::vector<int32_t> head;
+    thread_local std::vector<int32_t> chain;
+    head.assign(size_t(1) << hash_bits, -1);
+    bool use_chain = search_depth > 1;
+    if (use_chain && chain.size() < size)
+    {
+        chain.resize(size);
+    }
+    auto insert = [&](size_t pos)
+    {
+        uint32_t hash = lz_hash(base + pos, hash_bits);
+        if (use_chain)
+        {
+            chain[pos] = head[hash];
+        }
+        head[hash] = static_cast<int32_t>(pos);
+    };
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + LZ_MIN_MATCH <= size)
+    {
+        size_t best_length = 0;
+        size_t best_offset = 0;
+        int32_t candidate = head[lz_hash(base + pos, hash_bits)];
+        for (int i = 0; i < search_depth && candidate >= 0 && pos - candidate <= LZ_MAX_OFFSET; i++)
+        {
+            size_t length = 0;
+            while (pos + length < size && base[candidate + length] == base[pos + length])
+            {
+                length++;
+            }
+            if (length > best_length)
+            {
+                best_length = length;
+                best_offset = pos - candidate;
+            }
+            candidate = use_chain ? chain[candidate] : -1;
+        }
+
+        if (best_length < LZ_MIN_MATCH)
+        {
+            insert(pos++);
+            continue;
+        }
+
+        put_sequence(output, input.substr(anchor, pos - anchor), best_offset, best_length);
+        for (size_t end = pos + best_length; pos < end; pos++)
+        {
+            if (pos + LZ_MIN_MATCH <= size)
+            {
+                insert(pos);
+            }
+        }
+        anchor = pos;
+    }
+    put_sequence(output, input.substr(anchor), 0, 0);
+}
+
+static bool lz_decompress(std::string_view input, std::string &output)
+{
+    const char *ptr = input.data();
+    const char *limit = ptr + input.size();
+    uint32_t raw_size;
+    ptr = decode_varint32(ptr, limit, raw_size);
+    if (!ptr)
+    {
+        return false;
+    }
+
+    output.clear();
+    output.reserve(raw_size);
+    // Only the literal-only last sequence may end the stream.
+    while (true)
+    {
+        if (ptr >= limit)
+        {
+            return false;
+        }
+        uint8_t token = static_cast<uint8_t>(*ptr++);
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !get_length(ptr, limit, literal_length))
+        {
+            return false;
+        }
+        if (literal_length > static_cast<size_t>(limit - ptr) || output.size() + literal_length > raw_size)
+        {
+            return false;
+        }
+        output.append(ptr, literal_length);
+        ptr += literal_length;
+        if (ptr == limit)
+        {
+            break;
+        }
+
+        if (limit - ptr < 2)
+        {
+            return false;
+        }
+        size_t offset = static_cast<uint8_t>(ptr[0]) | static_cast<size_t>(static_cast<uint8_t>(ptr[1])) << 8;
+        ptr += 2;
+        size_t match_length = token & 0x0f;
+        if (match_length == 15 && !get_length(ptr, limit, match_length))
+        {
+            return false;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > output.size() || output.size() + match_length > raw_size)
+        {
+            return false;
+        }
+
+        // Byte at a time: the match may overlap the bytes it produces.
+        size_t start = output.size() - offset;
+        for (size_t i = 0; i < match_length; i++)
+        {
+            output.push_back(output[start + i]);
+        }
+    }
+    return output.size() == raw_size;
+}
+
+class LZCodec : public Codec
+{
+private:
+    CompressionType codec_type;
+    const char *codec_name;
+    int search_depth;
+
+public:
+    LZCodec(CompressionType type, const char *name, int depth) : codec_type(type), codec_name(name), search_depth(depth) {}
+
+    CompressionType type() const override { return codec_type; }
+    const char *name() const override { return codec_name; }
+
+    void compress(std::string_view input, std::string &output) const override
+    {
+        lz_compress(input, output, search_depth);
+    }
+
+    bool decompress(std::string_view input, std::string &output) const override
+    {
+        return lz_decompress(input, output);
+    }
+};
+
+static const LZCodec LZ_FAST_CODEC(CompressionType::LZFast, "lz-fast", LZ_FAST_SEARCH_DEPTH);
+static const LZCodec LZ_HIGH_CODEC(CompressionType::LZHigh, "lz-high", LZ_HIGH_SEARCH_DEPTH);
+
+const Codec *get_codec(CompressionType type)
+{
+    switch (type)
+    {
+    case CompressionType::LZFast:
+        return &LZ_FAST_CODEC;
+    case CompressionType::LZHigh:
+        return &LZ_HIGH_CODEC;
+    default:
+        return nullptr;
+    }
+}
+
+void CompressionCounters::record_write(size_t raw_size, size_t stored_size, bool compressed)
+{
+    (compressed ? blocks_compressed : blocks_stored_raw).fetch_add(1, std::memory_order_relaxed);
+    raw_bytes.fetch_add(raw_size, std::memory_order_relaxed);
+    stored_bytes.fetch_add(stored_size, std::memory_order_relaxed);
+}
+
+void CompressionCounters::record_read(size_t decompressed_size)
+{
+    blocks_decompressed.fetch_add(1, std::memory_order_relaxed);
+    decompressed_bytes.fetch_add(decompressed_size, std::memory_order_relaxed);
+}
+
+CompressionStats CompressionCounters::get_stats() const
+{
+    CompressionStats stats;
+    stats.blocks_compressed = blocks_compressed.load(std::memory_order_relaxed);
+    stats.blocks_stored_raw = blocks_stored_raw.load(std::memory_order_relaxed);
+    stats.raw_bytes = raw_bytes.load(std::memory_order_relaxed);
+    stats.stored_bytes = stored_bytes.load(std::memory_order_relaxed);
+    stats.blocks_decompressed = blocks_decompressed.load(std::memory_order_relaxed);
+    stats.decompressed_bytes = decompressed_bytes.load(std::memory_order_relaxed);
+    return stats;
+}
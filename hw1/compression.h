@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <cstdint>
+
+// Stored as the last byte of every block from SSTable format 9 on, so
+// values must never be reused.
+enum class CompressionType : uint8_t
+{
+    None = 0,
+    LZFast = 1,
+    LZHigh = 2
+};
+
+// A block codec. compress() may produce output larger than its input;
+// callers keep the raw block in that case. decompress() returns false on
+// malformed input.
+class Codec
+{
+public:
+    virtual ~Codec() = default;
+    virtual CompressionType type() const = 0;
+    virtual const char *name() const = 0;
+    virtual void compress(std::string_view input, std::string &output) const = 0;
+    virtual bool decompress(std::string_view input, std::string &output) const = 0;
+};
+
+// The built-in codec for type, or nullptr for None and unknown types.
+const Codec *get_codec(CompressionType type);
+
+struct CompressionStats
+{
+    uint64_t blocks_compressed = 0;
+    uint64_t blocks_stored_raw = 0;
+    uint64_t raw_bytes = 0;
+    uint64_t stored_bytes = 0;
+    uint64_t blocks_decompressed = 0;
+    uint64_t decompressed_bytes = 0;
+};
+
+// Shared by every table of a tree; writers and readers update it without
+// locking.
+class CompressionCounters
+{
+private:
+    std::atomic<uint64_t> blocks_compressed{0};
+    std::atomic<uint64_t> blocks_stored_raw{0};
+    std::atomic<uint64_t> raw_bytes{0};
+    std::atomic<uint64_t> stored_bytes{0};
+    std::atomic<uint64_t> blocks_decompressed{0};
+    std::atomic<uint64_t> decompressed_bytes{0};
+
+public:
+    void record_write(size_t raw_size, size_t stored_size, bool compressed);
+    void record_read(size_t decompressed_size);
+    CompressionStats get_stats() const;
+};
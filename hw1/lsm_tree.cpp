@@ -3,251 +3,1414 @@
 
 #include <fstream>
 #include <iostream>
-#include <chrono>
 #include <filesystem>
+#include <queue>
+#include <algorithm>
+#include <set>
+#include <numeric>
+#include <chrono>
+#include <iterator>
+
+#ifdef TEST_SMALL_SIZE
+const int TIER_COMPACTION_THRESHOLD = 2;
+const uint64_t MAX_SSTABLE_FILE_SIZE = 16 * 1024;
+const size_t TOMBSTONE_COMPACTION_MIN_ENTRIES = 8;
+const size_t LEVEL0_COMPACTION_TRIGGER = 2;
+const uint64_t LEVEL1_MAX_BYTES = 64 * 1024;
+#else
+const int TIER_COMPACTION_THRESHOLD = 10;
+const uint64_t MAX_SSTABLE_FILE_SIZE = 64 * 1024 * 1024;
+const size_t TOMBSTONE_COMPACTION_MIN_ENTRIES = 1000;
+const size_t LEVEL0_COMPACTION_TRIGGER = 4;
+const uint64_t LEVEL1_MAX_BYTES = 256 * 1024 * 1024;
+#endif
+const double TOMBSTONE_COMPACTION_RATIO = 0.5;
+const int LEVEL_SIZE_MULTIPLIER = 10;
+
+static size_t count_runs(const std::vector<std::shared_ptr<FileMeta>> &files)
+{
+    std::set<uint64_t> runs;
+    for (const auto &file : files)
+    {
+        runs.insert(file->run);
+    }
+    return runs.size();
+}
+
+static uint64_t total_file_size(const std::vector<std::shared_ptr<FileMeta>> &files)
+{
+    uint64_t size = 0;
+    for (const auto &file : files)
+    {
+        size += file->file_size;
+    }
+    return size;
+}
+
+static uint64_t max_bytes_for_level(int level)
+{
+    uint64_t size = LEVEL1_MAX_BYTES;
+    for (int l = 1; l < level; l++)
+    {
+        size *= LEVEL_SIZE_MULTIPLIER;
+    }
+    return size;
+}
+
+static bool in_range(const FileMeta &file, const std::string &key)
+{
+    return key >= file.smallest && key <= file.largest;
+}
+
+static bool overlaps(const FileMeta &file, const std::string &smallest, const std::string &largest)
+{
+    return file.largest >= smallest && file.smallest <= largest;
+}
+
+// True for a tier-0 layout and for levels left behind by tiered
+// compaction; leveled compaction merges those down whole.
+static bool has_overlaps(const std::vector<std::shared_ptr<FileMeta>> &files)
+{
+    std::vector<const FileMeta *> sorted;
+    for (const auto &file : files)
+    {
+        sorted.push_back(file.get());
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const FileMeta *a, const FileMeta *b)
+              { return a->smallest < b->smallest; });
+    for (size_t i = 1; i < sorted.size(); i++)
+    {
+        if (sorted[i]->smallest <= sorted[i - 1]->largest)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// versions holds one key's records, newest first. Keeps the newest one and,
+// for every snapshot, the newest one that snapshot can see. With
+// drop_deletions (nothing older exists below) deletions with nothing kept
+// beneath them go too.
+static void drop_hidden_versions(std::vector<std::pair<std::string, std::string>> &versions,
+                                 const std::vector<uint64_t> &snapshots, bool drop_deletions)
+{
+    size_t kept = 0;
+    uint64_t newer = 0;
+    for (size_t i = 0; i < versions.size(); i++)
+    {
+        uint64_t sequence = value_sequence(versions[i].second);
+        auto it = std::lower_bound(snapshots.begin(), snapshots.end(), sequence);
+        if (i == 0 || (it != snapshots.end() && *it < newer))
+        {
+            if (kept != i)
+            {
+                versions[kept] = std::move(versions[i]);
+            }
+            kept++;
+        }
+        newer = sequence;
+    }
+    versions.resize(kept);
+
+    while (drop_deletions && !versions.empty() && value_type(versions.back().second) == ValueType::Deletion)
+    {
+        versions.pop_back();
+    }
+}
+
+// A memtable's contents for flushing, without versions no snapshot needs.
+static std::vector<std::pair<std::string, std::string>> flush_data(const MemTable &table, const std::vector<uint64_t> &snapshots)
+{
+    std::vector<std::pair<std::string, std::string>> data;
+    std::vector<std::pair<std::string, std::string>> versions;
+    auto add_versions = [&]()
+    {
+        drop_hidden_versions(versions, snapshots, false);
+        std::move(versions.begin(), versions.end(), std::back_inserter(data));
+        versions.clear();
+    };
+
+    for (auto &entry : table.get_sorted_data())
+    {
+        if (!versions.empty() && versions.back().first != entry.first)
+        {
+            add_versions();
+        }
+        versions.push_back(std::move(entry));
+    }
+    add_versions();
+    return data;
+}
+
+static bool is_tombstone_heavy(const FileMeta &file)
+{
+    return file.num_entries >= TOMBSTONE_COMPACTION_MIN_ENTRIES &&
+           file.num_tombstones >= file.num_entries * TOMBSTONE_COMPACTION_RATIO;
+}
+
+LSMTree::LSMTree(const std::string &dir, const LSMOptions &opts)
+    : data_dir(dir), next_file_number(1), log_number(0), last_sequence(0), next_sequence(0), pending_switches(0), options(opts), running_compactions(0), shutting_down(false)
+{
+    memtable = std::make_shared<MemTable>();
+    if (options.max_immutable_memtables == 0)
+    {
+        options.max_immutable_memtables = 1;
+    }
+    if (options.compaction_threads == 0)
+    {
+        options.compaction_threads = 1;
+    }
+    if (options.block_cache_capacity > 0)
+    {
+        block_cache = std::make_unique<BlockCache>(options.block_cache_capacity);
+    }
+
+    SSTableOptions table_options;
+    table_options.use_mmap = options.use_mmap;
+    table_options.block_cache = block_cache.get();
+    table_options.pin_meta_blocks = options.pin_index_and_filter_blocks;
+    table_options.bloom_bits_per_key = options.bloom_false_positive_rate > 0
+                                           ? BloomFilter::bits_per_key_for(options.bloom_false_positive_rate)
+                                           : options.bloom_bits_per_key;
+    table_options.bloom_filter_type = options.bloom_filter_type;
+    table_options.compression_stats = &compression_stats;
+    table_cache = std::make_unique<TableCache>(options.max_open_files, table_options);
+    std::filesystem::create_directories(data_dir);
+
+    recover();
+    next_sequence = last_sequence;
+    install_version();
+    flush_thread = std::thread(&LSMTree::background_flush, this);
+    for (size_t i = 0; i < options.compaction_threads; i++)
+    {
+        compaction_workers.emplace_back(&LSMTree::background_compaction, this);
+    }
+}
+
+void LSMTree::recover()
+{
+    uint64_t sequence = 0;
+    bool has_current = std::filesystem::exists(data_dir + "/CURRENT");
+    bool recovered = Manifest::recover(data_dir, tiers, log_number, next_file_number, sequence);
+    last_sequence = sequence;
+    if (tiers.empty())
+    {
+        tiers.resize(1);
+    }
+    for (auto &tier : tiers)
+    {
+        for (auto &file : tier)
+        {
+            file->filename = make_filename("sst", file->number, ".sst");
+            if (file->smallest.empty() && file->largest.empty())
+            {
+                load_key_range(*file);
+            }
+        }
+    }
+
+    std::vector<std::pair<uint64_t, std::string>> logs;
+    std::vector<uint64_t> tables;
+    for (const auto &entry : std::filesystem::directory_iterator(data_dir))
+    {
+        std::string name = entry.path().filename().string();
+        unsigned long long number;
+        if (sscanf(name.c_str(), "wal_%llu.log", &number) == 1)
+        {
+            if (number >= log_number)
+            {
+                logs.emplace_back(number, entry.path().string());
+            }
+        }
+        else if (sscanf(name.c_str(), "sst_%llu.sst", &number) == 1)
+        {
+            tables.push_back(number);
+        }
+        else
+        {
+            continue;
+        }
+        next_file_number = std::max<uint64_t>(next_file_number, number + 1);
+    }
+
+    // Without a CURRENT, tables on disk predate the manifest: newer table
+    // numbers hold newer data, so they become tier 0 runs in number order.
+    if (!has_current && !tables.empty())
+    {
+        std::sort(tables.begin(), tables.end());
+        for (uint64_t number : tables)
+        {
+            add_existing_table(number);
+        }
+    }
+
+    manifest = std::make_unique<Manifest>(data_dir);
+    uint64_t manifest_number = next_file_number++;
+    bool created = manifest->create(manifest_number, tiers, log_number, next_file_number, last_sequence);
+    if (!created)
+    {
+        LOG_ERROR("Cannot create manifest in %s", data_dir.c_str());
+    }
+
+    std::sort(logs.begin(), logs.end());
+    for (const auto &log : logs)
+    {
+        replay_log(log.second);
+    }
+
+    if (memtable->size() > 0)
+    {
+        // There is no open log yet, so the replayed logs are attached to the
+        // immutable instead and go away with its flush. If that fails, the
+        // background flush retries it after opening.
+        switch_memtable();
+        for (const auto &log : logs)
+        {
+            immutables.back().log_files.push_back(log.second);
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!immutables.empty() && flush_immutable(lock))
+        {
+        }
+    }
+    else
+    {
+        new_wal();
+        VersionEdit edit;
+        edit.set_log_number(log_number);
+        edit.set_next_file_number(next_file_number);
+        edit.set_last_sequence(last_sequence);
+        log_and_apply(edit);
+    }
+
+    // Files missing from a damaged or absent manifest may still hold live
+    // data, and without a manifest of our own every MANIFEST-* looks
+    // obsolete. Leave them all for repair rather than guess.
+    if (has_current && !recovered)
+    {
+        LOG_ERROR("Manifest in %s is damaged; keeping unreferenced files", data_dir.c_str());
+    }
+    if (recovered && created)
+    {
+        delete_obsolete_files();
+    }
+}
+
+// Adopts a table found on disk that no manifest describes. One scan counts
+// its tombstones and finds its newest sequence, which reads must see.
+void LSMTree::add_existing_table(uint64_t number)
+{
+    std::string filename = make_filename("sst", number, ".sst");
+    std::shared_ptr<SSTable> sst(SSTable::open(filename, table_cache->options_for(number)));
+    if (!sst)
+    {
+        LOG_ERROR("Cannot open table %s", filename.c_str());
+        return;
+    }
+
+    size_t num_tombstones = 0;
+    uint64_t sequence = 0;
+    SSTableIterator it(sst.get(), 0, AccessPattern::Sequential);
+    while (it.has_next())
+    {
+        std::string value = it.next().second;
+        num_tombstones += value_type(value) == ValueType::Deletion;
+        sequence = std::max(sequence, value_sequence(value));
+    }
+    if (sequence > last_sequence)
+    {
+        last_sequence = sequence;
+    }
+    tiers[0].push_back(add_table_file(number, number, num_tombstones, std::move(sst)));
+}
+
+// Manifests written before key ranges were recorded leave them empty; they
+// are taken from the table once and kept by the next manifest.
+void LSMTree::load_key_range(FileMeta &file)
+{
+    std::shared_ptr<SSTable> sst = table_cache->find(file);
+    if (sst)
+    {
+        file.smallest = sst->get_smallest_key();
+        file.largest = sst->get_largest_key();
+    }
+}
+
+void LSMTree::replay_log(const std::string &log)
+{
+    LOG_DEBUG("Recovering WAL %s", log.c_str());
+
+    // Logs hold no sequence numbers. Everything in them is newer than every
+    // flushed table, so numbering continues from the recovered last sequence.
+    auto apply = [this](WALOpType type, std::string_view key, std::string_view value)
+    {
+        memtable->add(++last_sequence, type == WALOpType::Put ? ValueType::Value : ValueType::Deletion, key, value);
+    };
+    WriteAheadLog::replay(log, [&apply](std::string_view payload)
+                          { WriteAheadLog::decode_ops(payload, apply); });
+}
+
+void LSMTree::delete_obsolete_files()
+{
+    std::set<uint64_t> live_files;
+    for (const auto &tier : tiers)
+    {
+        for (const auto &file : tier)
+        {
+            live_files.insert(file->number);
+        }
+    }
+
+    for (const auto &entry : std::filesystem::directory_iterator(data_dir))
+    {
+        std::string name = entry.path().filename().string();
+        unsigned long long number;
+        bool obsolete = false;
+        if (sscanf(name.c_str(), "sst_%llu.sst", &number) == 1)
+        {
+            obsolete = live_files.count(number) == 0;
+        }
+        else if (sscanf(name.c_str(), "wal_%llu.log", &number) == 1)
+        {
+            // Logs of an unflushed immutable are older than log_number too.
+            obsolete = immutables.empty() && number < log_number;
+        }
+        else if (name.compare(0, 9, "MANIFEST-") == 0)
+        {
+            obsolete = entry.path().string() != manifest->get_filename();
+        }
+
+        if (obsolete)
+        {
+            LOG_DEBUG("Deleting obsolete file %s", name.c_str());
+            std::filesystem::remove(entry.path());
+        }
+    }
+}
+
+void LSMTree::log_and_apply(const VersionEdit &edit)
+{
+    if (!manifest->apply(edit))
+    {
+        LOG_ERROR("Failed to write manifest %s", manifest->get_filename().c_str());
+    }
+}
+
+void LSMTree::new_wal()
+{
+    if (!options.enable_wal)
+    {
+        log_number = next_file_number;
+        return;
+    }
+
+    log_number = next_file_number++;
+    wal = std::make_shared<WriteAheadLog>(make_filename("wal", log_number, ".log"), options.wal_sync_mode);
+    if (!wal->is_open())
+    {
+        wal.reset();
+    }
+}
+
+void LSMTree::write(const WriteBatch &batch)
+{
+    if (batch.size() == 0)
+    {
+        return;
+    }
+
+    // Sequence numbers and the record's place in the log are assigned under
+    // the lock. Waiting for the disk and inserting into the memtable happen
+    // outside it, so writers share fsyncs in GroupCommit mode and insert
+    // concurrently.
+    std::unique_lock<std::mutex> lock(mutex);
+    if (memtable->should_flush())
+    {
+        make_room_for_write(lock);
+    }
+    write_cv.wait(lock, [this]
+                  { return pending_switches == 0; });
+
+    uint64_t first = next_sequence + 1;
+    uint64_t last = next_sequence += batch.size();
+    std::shared_ptr<MemTable> table = memtable;
+    std::shared_ptr<WriteAheadLog> log;
+    uint64_t record_seq = 0;
+    if (wal && wal->add_record(batch.get_payload(), record_seq))
+    {
+        log = wal;
+    }
+    else if (wal)
+    {
+        LOG_ERROR("Failed to append to WAL %s", wal->get_filename().c_str());
+    }
+    lock.unlock();
+
+    // Applied only once durable, so no reader sees a write a crash can lose.
+    if (log && !log->wait_durable(record_seq))
+    {
+        LOG_ERROR("Failed to sync WAL %s", log->get_filename().c_str());
+    }
+    table->apply(batch, first);
+
+    lock.lock();
+    publish_write(lock, first, last);
+}
+
+// Writes become visible in sequence order: a batch is published, all at
+// once, when every earlier one has been. Returns once it is, so the writer
+// reads its own write.
+void LSMTree::publish_write(std::unique_lock<std::mutex> &lock, uint64_t first, uint64_t last)
+{
+    completed_writes[first] = last;
+    uint64_t published = last_sequence.load(std::memory_order_relaxed);
+    while (!completed_writes.empty() && completed_writes.begin()->first == published + 1)
+    {
+        published = completed_writes.begin()->second;
+        completed_writes.erase(completed_writes.begin());
+    }
+    last_sequence.store(published, std::memory_order_release);
+    write_cv.notify_all();
+    write_cv.wait(lock, [this, last]
+                  { return last_sequence.load(std::memory_order_relaxed) >= last; });
+}
+
+void LSMTree::install_version()
+{
+    auto version = std::make_shared<Version>();
+    version->memtable = memtable;
+    for (const auto &imm : immutables)
+    {
+        version->immutables.push_back(imm.table);
+    }
+    version->tiers = tiers;
+    std::atomic_store(&current, std::shared_ptr<const Version>(std::move(version)));
+}
+
+std::shared_ptr<const Version> LSMTree::get_version() const
+{
+    return std::atomic_load(&current);
+}
+
+// Taken after get_version(): the pinned version's tables were written from
+// writes published before it, so they still hold every version the
+// sequence can see.
+uint64_t LSMTree::read_sequence(const Snapshot *snapshot) const
+{
+    return snapshot ? snapshot->sequence : last_sequence.load(std::memory_order_acquire);
+}
+
+std::vector<uint64_t> LSMTree::live_snapshots() const
+{
+    return std::vector<uint64_t>(snapshots.begin(), snapshots.end());
+}
+
+const Snapshot *LSMTree::get_snapshot()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t sequence = last_sequence.load(std::memory_order_relaxed);
+    snapshots.insert(sequence);
+    return new Snapshot(sequence);
+}
+
+void LSMTree::release_snapshot(const Snapshot *snapshot)
+{
+    if (!snapshot)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = snapshots.find(snapshot->sequence);
+    if (it != snapshots.end())
+    {
+        snapshots.erase(it);
+    }
+    delete snapshot;
+    // Bottom tiers held back for their tombstones can be rewritten now.
+    if (snapshots.empty())
+    {
+        compaction_cv.notify_all();
+    }
+}
+
+void LSMTree::purge_obsolete_files()
+{
+    // A file can go once no published Version refers to it any more.
+    auto it = obsolete_files.begin();
+    while (it != obsolete_files.end())
+    {
+        if (it->use_count() > 1)
+        {
+            ++it;
+            continue;
+        }
+
+        const FileMeta &file = **it;
+        table_cache->evict(file.number);
+        if (block_cache)
+        {
+            block_cache->erase_file(file.number);
+        }
+        std::filesystem::remove(file.filename);
+        it = obsolete_files.erase(it);
+    }
+}
+
+LSMTree::~LSMTree()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutting_down = true;
+    }
+    background_cv.notify_all();
+    compaction_cv.notify_all();
+    if (flush_thread.joinable())
+    {
+        flush_thread.join();
+    }
+    for (auto &worker : compaction_workers)
+    {
+        worker.join();
+    }
+    purge_obsolete_files();
+}
+
+void LSMTree::put(const std::string &key, const std::string &value)
+{
+    WriteBatch batch;
+    batch.put(key, value);
+    write(batch);
+}
+
+std::string LSMTree::get(const std::string &key, const Snapshot *snapshot)
+{
+    std::shared_ptr<const Version> version = get_version();
+    uint64_t sequence = read_sequence(snapshot);
+    std::string value;
+
+    auto result = [&value]()
+    {
+        if (value_type(value) != ValueType::Value)
+        {
+            return std::string();
+        }
+        value.erase(0, VALUE_TAG_SIZE);
+        return std::move(value);
+    };
+
+    if (version->memtable->get(key, value, sequence))
+    {
+        return result();
+    }
+
+    for (auto it = version->immutables.rbegin(); it != version->immutables.rend(); ++it)
+    {
+        if ((*it)->get(key, value, sequence))
+        {
+            return result();
+        }
+    }
+
+    const Tiers &tiers = version->tiers;
+    for (size_t t = 0; t < tiers.size(); t++)
+    {
+        for (auto it = tiers[t].rbegin(); it != tiers[t].rend(); ++it)
+        {
+            if (!in_range(**it, key))
+            {
+                continue;
+            }
+            std::shared_ptr<SSTable> sst = table_cache->find(**it);
+            if (sst && sst->get(key, value, sequence))
+            {
+                return result();
+            }
+        }
+    }
+
+    return "";
+}
+
+std::vector<std::string> LSMTree::multi_get(const std::vector<std::string> &keys, const Snapshot *snapshot)
+{
+    std::shared_ptr<const Version> version = get_version();
+    uint64_t sequence = read_sequence(snapshot);
+
+    // Sort and deduplicate once; every table is then probed with the keys
+    // still unresolved, in order.
+    std::vector<size_t> order(keys.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b)
+              { return keys[a] < keys[b]; });
+
+    std::vector<const std::string *> sorted_keys;
+    std::vector<size_t> slot(keys.size());
+    for (size_t idx : order)
+    {
+        if (sorted_keys.empty() || *sorted_keys.back() != keys[idx])
+        {
+            sorted_keys.push_back(&keys[idx]);
+        }
+        slot[idx] = sorted_keys.size() - 1;
+    }
+
+    std::vector<std::string> values(sorted_keys.size());
+    std::vector<size_t> pending(sorted_keys.size());
+    std::iota(pending.begin(), pending.end(), 0);
+    std::vector<size_t> remaining;
+
+    auto probe_memtable = [&](const MemTable &table)
+    {
+        remaining.clear();
+        for (size_t p : pending)
+        {
+            if (!table.get(*sorted_keys[p], values[p], sequence))
+            {
+                remaining.push_back(p);
+            }
+        }
+        pending.swap(remaining);
+    };
+
+    probe_memtable(*version->memtable);
+    for (auto it = version->immutables.rbegin(); it != version->immutables.rend(); ++it)
+    {
+        probe_memtable(**it);
+    }
+
+    std::vector<std::string_view> batch;
+    std::vector<bool> found;
+    std::vector<std::string> table_values;
+    for (const auto &tier : version->tiers)
+    {
+        for (auto it = tier.rbegin(); it != tier.rend() && !pending.empty(); ++it)
+        {
+            // pending stays sorted, so the keys in the file's range are a
+            // contiguous slice of it.
+            const FileMeta &file = **it;
+            auto first = std::lower_bound(pending.begin(), pending.end(), file.smallest, [&sorted_keys](size_t p, const std::string &key)
+                                          { return *sorted_keys[p] < key; });
+            auto last = std::upper_bound(first, pending.end(), file.largest, [&sorted_keys](const std::string &key, size_t p)
+                                         { return key < *sorted_keys[p]; });
+            if (first == last)
+            {
+                continue;
+            }
+            std::shared_ptr<SSTable> sst = table_cache->find(file);
+            if (!sst)
+            {
+                continue;
+            }
+
+            batch.clear();
+            for (auto p = first; p != last; ++p)
+            {
+                batch.push_back(*sorted_keys[*p]);
+            }
+            sst->multi_get(batch, found, table_values, sequence);
+
+            remaining.assign(pending.begin(), first);
+            for (size_t j = 0; j < batch.size(); j++)
+            {
+                size_t p = first[j];
+                if (found[j])
+                {
+                    values[p] = std::move(table_values[j]);
+                }
+                else
+                {
+                    remaining.push_back(p);
+                }
+            }
+            remaining.insert(remaining.end(), last, pending.end());
+            pending.swap(remaining);
+        }
+    }
+
+    std::vector<std::string> result(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        const std::string &value = values[slot[i]];
+        if (value_type(value) == ValueType::Value)
+        {
+            result[i] = user_value(value);
+        }
+    }
+    return result;
+}
+
+void LSMTree::remove(const std::string &key)
+{
+    WriteBatch batch;
+    batch.remove(key);
+    write(batch);
+}
+
+std::vector<std::pair<std::string, std::string>> LSMTree::scan(const std::string &start, const std::string &end, int limit,
+                                                               const Snapshot *snapshot)
+{
+    std::vector<std::pair<std::string, std::string>> result;
+    std::unique_ptr<Iterator> it = new_iterator(snapshot);
+    it->set_upper_bound(end);
+    for (it->seek(start); it->valid() && it->key() <= end && result.size() < static_cast<size_t>(limit); it->next())
+    {
+        result.emplace_back(it->key(), it->value());
+    }
+    return result;
+}
+
+std::unique_ptr<LSMTree::Iterator> LSMTree::new_iterator(const Snapshot *snapshot)
+{
+    std::shared_ptr<const Version> version = get_version();
+    uint64_t sequence = read_sequence(snapshot);
+    return std::unique_ptr<Iterator>(new Iterator(std::move(version), table_cache.get(), sequence));
+}
+
+LSMTree::Iterator::Iterator(std::shared_ptr<const Version> v, TableCache *cache, uint64_t seq)
+    : version(std::move(v)), table_cache(cache), sequence(seq), has_upper_bound(false), is_valid(false)
+{
+    for (const auto &tier : version->tiers)
+    {
+        for (auto it = tier.rbegin(); it != tier.rend(); ++it)
+        {
+            files.push_back(it->get());
+        }
+    }
+    tables.resize(files.size());
+    table_iterators.resize(files.size());
+
+    memtable_iterators.emplace_back(version->memtable.get());
+    for (auto it = version->immutables.rbegin(); it != version->immutables.rend(); ++it)
+    {
+        memtable_iterators.emplace_back(it->get());
+    }
+}
+
+bool LSMTree::Iterator::valid() const
+{
+    return is_valid;
+}
+
+void LSMTree::Iterator::set_upper_bound(const std::string &key)
+{
+    upper_bound = key;
+    has_upper_bound = true;
+}
+
+void LSMTree::Iterator::seek_to_first()
+{
+    seek(std::string());
+}
+
+void LSMTree::Iterator::seek(const std::string &target)
+{
+    heap = decltype(heap)();
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        // Tables outside [target, upper_bound] are neither opened nor read.
+        if (files[i]->largest < target || (has_upper_bound && files[i]->smallest > upper_bound))
+        {
+            table_iterators[i].reset();
+            continue;
+        }
+        if (!tables[i])
+        {
+            tables[i] = table_cache->find(*files[i]);
+            if (!tables[i])
+            {
+                continue;
+            }
+        }
+        if (table_iterators[i])
+        {
+            table_iterators[i]->seek(target);
+        }
+        else
+        {
+            table_iterators[i] = std::make_unique<SSTableIterator>(tables[i].get(), memtable_iterators.size() + i, target);
+        }
+        push_next(i);
+    }
 
-#ifdef TEST_SMALL_SIZE
-const int TIER_COMPACTION_THRESHOLD = 2;
-#else
-const int TIER_COMPACTION_THRESHOLD = 10;
-#endif
+    for (size_t i = 0; i < memtable_iterators.size(); i++)
+    {
+        memtable_iterators[i].seek(target);
+        push_next(files.size() + i);
+    }
+
+    find_visible();
+}
 
-LSMTree::LSMTree(const std::string &dir) : data_dir(dir)
+void LSMTree::Iterator::next()
 {
-    memtable = std::make_unique<MemTable>();
-    tiers.resize(1);
-    std::filesystem::create_directories(data_dir);
+    find_visible();
+}
+
+const std::string &LSMTree::Iterator::key() const
+{
+    return current_key;
 }
 
-LSMTree::~LSMTree() = default;
+const std::string &LSMTree::Iterator::value() const
+{
+    return current_value;
+}
 
-void LSMTree::put(const std::string &key, const std::string &value)
+void LSMTree::Iterator::push_next(size_t source)
 {
-    memtable->put(key, value);
+    if (source < files.size())
+    {
+        SSTableIterator *it = table_iterators[source].get();
+        if (it && it->has_next())
+        {
+            auto [key, value] = it->next();
+            heap.push({std::move(key), std::move(value), source, it->get_order()});
+        }
+        return;
+    }
 
-    if (memtable->should_flush())
+    size_t m = source - files.size();
+    MemTable::Iterator &it = memtable_iterators[m];
+    if (it.valid())
     {
-        flush_memtable();
+        heap.push({std::string(it.key()), std::string(it.value()), source, m});
+        it.next();
     }
 }
 
-std::string LSMTree::get(const std::string &key)
+// Pops versions until the newest visible version of some key is a value;
+// that key's remaining versions are consumed with it.
+void LSMTree::Iterator::find_visible()
 {
-    std::string value;
-
-    if (memtable->get(key, value))
+    is_valid = false;
+    while (!heap.empty())
     {
-        if (value == TOMBSTONE)
+        if (has_upper_bound && std::get<0>(heap.top()) > upper_bound)
+        {
+            return;
+        }
+        auto [key, value, source, order] = heap.top();
+        heap.pop();
+        push_next(source);
+        if (value_sequence(value) > sequence)
         {
-            return "";
+            continue;
+        }
+
+        while (!heap.empty() && std::get<0>(heap.top()) == key)
+        {
+            size_t older = std::get<2>(heap.top());
+            heap.pop();
+            push_next(older);
+        }
+
+        if (value_type(value) == ValueType::Value)
+        {
+            current_key = std::move(key);
+            current_value = user_value(value);
+            is_valid = true;
+            return;
         }
-        return value;
     }
+}
 
-    for (int t = 0; t < tiers.size(); t++)
+// New writes wait while this runs; the ones already assigned sequence
+// numbers finish inserting into the current memtable before it is switched.
+void LSMTree::make_room_for_write(std::unique_lock<std::mutex> &lock)
+{
+    pending_switches++;
+    while (true)
     {
-        for (auto it = tiers[t].rbegin(); it != tiers[t].rend(); ++it)
+        if (immutables.size() >= options.max_immutable_memtables)
         {
-            SSTable *sst = it->get();
-            if (sst->get(key, value))
-            {
-                if (value == TOMBSTONE)
-                {
-                    return "";
-                }
-                return value;
-            }
+            LOG_DEBUG("Write stalled: %zu immutable memtables waiting for flush", immutables.size());
+            flush_done_cv.wait(lock);
+        }
+        else if (last_sequence.load(std::memory_order_relaxed) != next_sequence)
+        {
+            write_cv.wait(lock);
+        }
+        else
+        {
+            break;
         }
     }
 
-    return "";
+    // Another writer may have switched it while this one was stalled.
+    if (memtable->size() > 0)
+    {
+        switch_memtable();
+        background_cv.notify_one();
+    }
+    pending_switches--;
+    write_cv.notify_all();
 }
 
-void LSMTree::remove(const std::string &key)
+void LSMTree::switch_memtable()
 {
-    memtable->put(key, TOMBSTONE);
+    LOG_DEBUG("Switching MemTable (%zu bytes)", memtable->size());
 
-    if (memtable->should_flush())
+    ImmutableMemTable imm{memtable, log_number, {}};
+    if (wal)
     {
-        flush_memtable();
+        imm.log_files.push_back(wal->get_filename());
     }
+    immutables.push_back(std::move(imm));
+    memtable = std::make_shared<MemTable>();
+    new_wal();
+    install_version();
 }
 
-std::vector<std::pair<std::string, std::string>> LSMTree::scan(const std::string &start, const std::string &end, int limit)
+void LSMTree::background_flush()
 {
-    std::vector<std::unique_ptr<SSTableIterator>> iterators;
-
-    for (int t = static_cast<int>(tiers.size()) - 1; t >= 0; t--)
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
     {
-        for (auto it = tiers[t].begin(); it != tiers[t].end(); ++it)
+        background_cv.wait(lock, [this]
+                           { return shutting_down || !immutables.empty(); });
+        if (immutables.empty())
         {
-            SSTable *sst = it->get();
-            auto iterator = std::make_unique<SSTableIterator>(sst->get_filename(), t);
+            break;
+        }
 
-            while (iterator->has_next())
+        if (!flush_immutable(lock))
+        {
+            if (shutting_down)
             {
-                auto [key, value] = iterator->next();
-                if (key >= start && key <= end)
-                {
-                    iterators.push_back(std::move(iterator));
-                    break;
-                }
-                else if (key > end)
-                {
-                    break;
-                }
+                break;
             }
+            background_cv.wait_for(lock, std::chrono::milliseconds(100));
         }
     }
+}
+
+bool LSMTree::flush_immutable(std::unique_lock<std::mutex> &lock)
+{
+    ImmutableMemTable imm = immutables.front();
+    uint64_t number = next_file_number++;
+    std::vector<uint64_t> snapshot_list = live_snapshots();
+
+    lock.unlock();
+    LOG_DEBUG("Flushing immutable MemTable (%zu bytes)", imm.table->size());
+    std::shared_ptr<FileMeta> file = write_sstable(number, flush_data(*imm.table, snapshot_list));
+    lock.lock();
+
+    if (!file)
+    {
+        LOG_ERROR("Failed to flush MemTable to %s", make_filename("sst", number, ".sst").c_str());
+        return false;
+    }
+
+    tiers[0].push_back(file);
+    immutables.pop_front();
+    install_version();
+
+    VersionEdit edit;
+    edit.add_file(0, *file);
+    edit.set_log_number(immutables.empty() ? log_number : immutables.front().log_number);
+    edit.set_next_file_number(next_file_number);
+    edit.set_last_sequence(last_sequence);
+    log_and_apply(edit);
 
-    auto mem_results = memtable->scan(start, end, limit);
+    for (const auto &log_file : imm.log_files)
+    {
+        std::filesystem::remove(log_file);
+    }
+    purge_obsolete_files();
+    flush_done_cv.notify_all();
+    compaction_cv.notify_all();
+    return true;
+}
 
-    using HeapEntry = std::tuple<std::string, std::string, size_t, size_t>;
-    auto cmp = [](const HeapEntry &a, const HeapEntry &b)
+void LSMTree::background_compaction()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
     {
-        if (std::get<0>(a) != std::get<0>(b))
+        int tier = -1;
+        compaction_cv.wait(lock, [this, &tier]
+                           {
+            tier = pick_compaction();
+            return shutting_down || tier >= 0; });
+        if (shutting_down)
         {
-            return std::get<0>(a) > std::get<0>(b);
+            break;
         }
-        return std::get<3>(a) > std::get<3>(b);
-    };
-    std::priority_queue<HeapEntry, std::vector<HeapEntry>, decltype(cmp)> heap(cmp);
 
-    for (size_t i = 0; i < iterators.size(); i++)
-    {
-        if (iterators[i]->has_next())
+        // A compaction reads tier and appends to tier + 1, so both stay
+        // reserved until its result is installed.
+        busy_tiers.insert(tier);
+        busy_tiers.insert(tier + 1);
+        running_compactions++;
+        bool ok = compact_tier(tier, lock);
+        busy_tiers.erase(tier);
+        busy_tiers.erase(tier + 1);
+        running_compactions--;
+        compaction_cv.notify_all();
+
+        if (!ok)
         {
-            auto [key, value] = iterators[i]->next();
-            heap.push({key, value, i, iterators[i]->get_order()});
+            compaction_cv.wait_for(lock, std::chrono::milliseconds(100));
         }
     }
+}
 
-    for (size_t i = 0; i < mem_results.size(); i++)
+int LSMTree::pick_compaction() const
+{
+    int best_tier = -1;
+    double best_score = 0;
+    for (size_t t = 0; t < tiers.size(); t++)
     {
-        heap.push({mem_results[i].first, mem_results[i].second, iterators.size() + i, tiers.size()});
+        double score = compaction_score(t);
+        if (score >= 1.0 && score > best_score && busy_tiers.count(t) == 0 && busy_tiers.count(t + 1) == 0)
+        {
+            best_tier = t;
+            best_score = score;
+        }
     }
+    return best_tier;
+}
 
-    std::vector<std::pair<std::string, std::string>> result;
-    std::string last_key;
+double LSMTree::compaction_score(int tier) const
+{
+    const auto &files = tiers[tier];
+    bool leveled = options.compaction_style == CompactionStyle::Leveled;
+    double score;
+    if (!leveled)
+    {
+        score = static_cast<double>(count_runs(files)) / TIER_COMPACTION_THRESHOLD;
+    }
+    else if (tier == 0)
+    {
+        score = static_cast<double>(files.size()) / LEVEL0_COMPACTION_TRIGGER;
+    }
+    else
+    {
+        score = static_cast<double>(total_file_size(files)) / max_bytes_for_level(tier);
+        if (score < 1.0 && has_overlaps(files))
+        {
+            score = 1.0;
+        }
+    }
 
-    while (!heap.empty() && result.size() < limit)
+    // Push mostly-deleted files down early so the bottom tier can drop
+    // their tombstones. A bottom level has nowhere better to put them; a
+    // bottom tier is rewritten in place, but only with no snapshot open.
+    // A snapshot may need every tombstone, and a rewrite that kept them all
+    // would be picked again straight away.
+    bool bottom = is_bottom(tier);
+    if (score < 1.0 && (!bottom || (!leveled && snapshots.empty())) &&
+        std::any_of(files.begin(), files.end(), [](const std::shared_ptr<FileMeta> &file)
+                    { return is_tombstone_heavy(*file); }))
     {
-        auto [key, value, iterator_idx, order] = heap.top();
-        heap.pop();
+        score = 1.0;
+    }
+    return score;
+}
 
-        if (key != last_key)
+// Nothing lives below tier.
+bool LSMTree::is_bottom(int tier) const
+{
+    for (size_t t = tier + 1; t < tiers.size(); t++)
+    {
+        if (!tiers[t].empty())
         {
-            if (value != TOMBSTONE)
-            {
-                result.emplace_back(key, value);
-            }
-            last_key = key;
+            return false;
         }
+    }
+    return true;
+}
+
+// Level 0 and overlapping levels are compacted whole. Otherwise a single
+// file goes: the one rewriting the fewest next-level bytes per byte of its
+// own, among the tombstone-heavy files if there are any. next_inputs gets
+// every next-level file overlapping the inputs' key range.
+void LSMTree::pick_level_inputs(int level, std::vector<std::shared_ptr<FileMeta>> &inputs,
+                                std::vector<std::shared_ptr<FileMeta>> &next_inputs) const
+{
+    const auto &files = tiers[level];
+    static const std::vector<std::shared_ptr<FileMeta>> no_files;
+    const auto &next = level + 1 < static_cast<int>(tiers.size()) ? tiers[level + 1] : no_files;
 
-        if (iterator_idx < iterators.size())
+    if (level == 0 || has_overlaps(files))
+    {
+        inputs = files;
+    }
+    else
+    {
+        bool tombstones_only = !is_bottom(level) && std::any_of(files.begin(), files.end(), [](const std::shared_ptr<FileMeta> &file)
+                                                                { return is_tombstone_heavy(*file); });
+        std::shared_ptr<FileMeta> best;
+        double best_cost = 0;
+        for (const auto &file : files)
         {
-            if (iterators[iterator_idx]->has_next())
+            if (tombstones_only && !is_tombstone_heavy(*file))
             {
-                auto [next_key, next_value] = iterators[iterator_idx]->next();
-                if (next_key <= end)
+                continue;
+            }
+            uint64_t overlap = 0;
+            for (const auto &other : next)
+            {
+                if (overlaps(*other, file->smallest, file->largest))
                 {
-                    heap.push({next_key, next_value, iterator_idx, order});
+                    overlap += other->file_size;
                 }
             }
+            double cost = static_cast<double>(overlap) / std::max<uint64_t>(file->file_size, 1);
+            if (!best || cost < best_cost)
+            {
+                best = file;
+                best_cost = cost;
+            }
         }
+        inputs.push_back(best);
     }
 
-    return result;
-}
-
-void LSMTree::flush_memtable()
-{
-    if (memtable->size() == 0)
-        return;
-
-    LOG_DEBUG("Flushing MemTable (%zu bytes)", memtable->size());
-
-    auto sorted_data = memtable->get_sorted_data();
-    std::string filename = generate_sstable_filename();
-    std::unique_ptr<SSTable> sst(SSTable::create_from_sorted_data(filename, sorted_data));
-
-    if (sst)
+    std::string smallest = inputs.front()->smallest;
+    std::string largest = inputs.front()->largest;
+    for (const auto &file : inputs)
     {
-        tiers[0].push_back(std::move(sst));
-        memtable->clear();
+        smallest = std::min(smallest, file->smallest);
+        largest = std::max(largest, file->largest);
+    }
 
-        compact_tier(0);
+    // If the next level still overlaps itself, file order decides which
+    // version wins there, so it is merged whole to keep that order.
+    bool whole_next = has_overlaps(next);
+    for (const auto &file : next)
+    {
+        if (whole_next || overlaps(*file, smallest, largest))
+        {
+            next_inputs.push_back(file);
+        }
     }
 }
 
+void LSMTree::wait_for_compactions()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    compaction_cv.wait(lock, [this]
+                       { return running_compactions == 0 && pick_compaction() < 0; });
+}
+
 void LSMTree::manual_flush()
 {
-    flush_memtable();
+    std::unique_lock<std::mutex> lock(mutex);
+    if (memtable->size() > 0)
+    {
+        make_room_for_write(lock);
+    }
+    while (!immutables.empty())
+    {
+        flush_done_cv.wait(lock);
+    }
 }
 
 void LSMTree::print_stats() const
 {
+    std::lock_guard<std::mutex> lock(mutex);
     LOG_DEBUG("LSM Tree Stats:");
     LOG_DEBUG("  MemTable size: %zu bytes", memtable->size());
-    LOG_DEBUG("  Tiers: %zu", tiers.size());
+    LOG_DEBUG("  Immutable MemTables: %zu", immutables.size());
+    LOG_DEBUG("  Tiers: %zu (%s, %zu compactions running)", tiers.size(),
+              options.compaction_style == CompactionStyle::Leveled ? "leveled" : "tiered", running_compactions);
     for (size_t i = 0; i < tiers.size(); i++)
     {
-        LOG_DEBUG("  Tier %zu: %zu files", i, tiers[i].size());
+        LOG_DEBUG("  Tier %zu: %zu files in %zu runs", i, tiers[i].size(), count_runs(tiers[i]));
+    }
+    LOG_DEBUG("  Table cache: %zu open, %zu hits, %zu misses",
+              table_cache->size(), table_cache->get_hits(), table_cache->get_misses());
+#ifdef DEBUG
+    // Only read for the log lines, which are compiled out without DEBUG.
+    if (block_cache)
+    {
+        for (size_t i = 0; i < block_cache->get_num_shards(); i++)
+        {
+            BlockCacheStats stats = block_cache->get_shard_stats(i);
+            LOG_DEBUG("  Block cache shard %zu: %zu entries, %zu bytes (%zu pinned), %zu hits, %zu misses, %zu evictions",
+                      i, stats.entries, stats.usage, stats.pinned_usage, stats.hits, stats.misses, stats.evictions);
+        }
     }
+    CompressionStats compression = compression_stats.get_stats();
+    LOG_DEBUG("  Compression: %llu blocks compressed, %llu stored raw, %llu -> %llu bytes (%.2fx), %llu blocks decompressed",
+              (unsigned long long)compression.blocks_compressed, (unsigned long long)compression.blocks_stored_raw,
+              (unsigned long long)compression.raw_bytes, (unsigned long long)compression.stored_bytes,
+              compression.stored_bytes > 0 ? (double)compression.raw_bytes / compression.stored_bytes : 1.0,
+              (unsigned long long)compression.blocks_decompressed);
+#endif
 }
 
-void LSMTree::compact_tier(int tier)
+bool LSMTree::compact_tier(int tier, std::unique_lock<std::mutex> &lock)
 {
-    if (tiers[tier].size() < TIER_COMPACTION_THRESHOLD)
+    LOG_DEBUG("Compacting tier %d with %zu files", tier, tiers[tier].size());
+
+    std::vector<std::shared_ptr<FileMeta>> inputs;
+    std::vector<std::shared_ptr<FileMeta>> next_inputs;
+    std::vector<std::shared_ptr<FileMeta>> outputs;
+    int output_tier = tier + 1;
+    bool bottom;
+
+    if (options.compaction_style == CompactionStyle::Leveled)
     {
-        return;
+        pick_level_inputs(tier, inputs, next_inputs);
+
+        // Files left in the next level lie outside the inputs' key range, so
+        // only the levels below it can hold older versions.
+        bottom = is_bottom(tier + 1);
+        if (inputs.size() == 1 && next_inputs.empty() && !(bottom && inputs[0]->num_tombstones > 0))
+        {
+            move_file(tier, inputs[0]);
+            return true;
+        }
+    }
+    else
+    {
+        inputs = tiers[tier];
+
+        // With nothing in tier + 1 or below, the inputs hold the oldest
+        // version of every key and tombstones have nothing left to hide.
+        // Nothing can add files there while tier + 1 is reserved in
+        // busy_tiers.
+        bottom = is_bottom(tier);
+
+        // A bottom tier picked only for its tombstones is rewritten in place
+        // rather than pushed into a new tier. Tier 0 always moves down, since
+        // flushes may append newer files to it during the merge.
+        if (bottom && tier > 0 && count_runs(inputs) < TIER_COMPACTION_THRESHOLD)
+        {
+            output_tier = tier;
+        }
     }
 
-    LOG_DEBUG("Compacting tier %zu with %zu files", tier, tiers[tier].size());
+    // merge_sstables takes later files as newer.
+    std::vector<std::shared_ptr<FileMeta>> merge_inputs = next_inputs;
+    merge_inputs.insert(merge_inputs.end(), inputs.begin(), inputs.end());
+
+    // Snapshots taken during the merge are newer than every input record,
+    // so they only need the newest versions, which are always kept.
+    std::vector<uint64_t> snapshot_list = live_snapshots();
 
-    if (tier + 1 >= tiers.size())
+    // Readers keep using the input files while the merge runs unlocked.
+    lock.unlock();
+    bool ok = merge_sstables(merge_inputs, snapshot_list, bottom, output_tier, outputs);
+    lock.lock();
+
+    if (!ok)
     {
-        tiers.resize(tier + 2);
+        LOG_ERROR("Failed to compact tier %d", tier);
+        return false;
+    }
+
+    if (static_cast<size_t>(output_tier) >= tiers.size())
+    {
+        tiers.resize(output_tier + 1);
     }
 
-    std::string new_filename = generate_sstable_filename();
-    std::unique_ptr<SSTable> merged = merge_sstables(tiers[tier], new_filename);
+    VersionEdit edit;
+    for (auto &file : inputs)
+    {
+        edit.delete_file(tier, file->number);
+    }
+    for (auto &file : next_inputs)
+    {
+        edit.delete_file(tier + 1, file->number);
+    }
+    for (auto &file : outputs)
+    {
+        edit.add_file(output_tier, *file);
+    }
+    edit.set_next_file_number(next_file_number);
+    log_and_apply(edit);
 
-    if (merged)
+    auto remove_inputs = [](std::vector<std::shared_ptr<FileMeta>> &files, const std::vector<std::shared_ptr<FileMeta>> &merged)
     {
-        for (auto &sst : tiers[tier])
+        std::set<uint64_t> merged_numbers;
+        for (auto &file : merged)
         {
-            std::filesystem::remove(sst->get_filename());
+            merged_numbers.insert(file->number);
         }
-        tiers[tier].clear();
+        files.erase(std::remove_if(files.begin(), files.end(), [&merged_numbers](const std::shared_ptr<FileMeta> &file)
+                                   { return merged_numbers.count(file->number) > 0; }),
+                    files.end());
+    };
+    remove_inputs(tiers[tier], inputs);
+    if (!next_inputs.empty())
+    {
+        remove_inputs(tiers[tier + 1], next_inputs);
+    }
 
-        tiers[tier + 1].push_back(std::move(merged));
+    tiers[output_tier].insert(tiers[output_tier].end(), outputs.begin(), outputs.end());
+    install_version();
 
-        compact_tier(tier + 1);
-    }
+    obsolete_files.insert(obsolete_files.end(), merge_inputs.begin(), merge_inputs.end());
+    inputs.clear();
+    next_inputs.clear();
+    merge_inputs.clear();
+    purge_obsolete_files();
+    return true;
 }
 
-std::unique_ptr<SSTable> LSMTree::merge_sstables(const std::vector<std::unique_ptr<SSTable>> &sstables, const std::string &new_filename)
+// Moves a file that overlaps nothing in the next level down as it is,
+// without rewriting it.
+void LSMTree::move_file(int tier, const std::shared_ptr<FileMeta> &file)
 {
-    LOG_DEBUG("Merging %zu SSTables using external merge sort", sstables.size());
+    LOG_DEBUG("Moving %s from tier %d to %d", file->filename.c_str(), tier, tier + 1);
 
-    std::vector<std::unique_ptr<SSTableIterator>> iterators;
-    for (size_t i = 0; i < sstables.size(); i++)
+    if (tier + 1 >= static_cast<int>(tiers.size()))
     {
-        size_t order = sstables.size() - 1 - i;
-        iterators.push_back(std::make_unique<SSTableIterator>(sstables[i]->get_filename(), order));
+        tiers.resize(tier + 2);
     }
 
-    using HeapEntry = std::tuple<std::string, std::string, size_t, size_t>;
-    auto cmp = [](const HeapEntry &a, const HeapEntry &b)
+    VersionEdit edit;
+    edit.delete_file(tier, file->number);
+    edit.add_file(tier + 1, *file);
+    log_and_apply(edit);
+
+    auto &files = tiers[tier];
+    files.erase(std::remove(files.begin(), files.end(), file), files.end());
+    tiers[tier + 1].push_back(file);
+    install_version();
+}
+
+// Streams the merged records into SSTableBuilders, so memory stays at one
+// block per input plus the output block. The output becomes one sorted run
+// split into files of about MAX_SSTABLE_FILE_SIZE. Only the versions the
+// snapshots need are kept; with drop_tombstones deleted keys are left out too.
+bool LSMTree::merge_sstables(const std::vector<std::shared_ptr<FileMeta>> &files, const std::vector<uint64_t> &snapshots,
+                             bool drop_tombstones, int output_tier, std::vector<std::shared_ptr<FileMeta>> &outputs)
+{
+    LOG_DEBUG("Merging %zu SSTables using external merge sort", files.size());
+
+    std::vector<std::shared_ptr<SSTable>> sstables;
+    std::vector<std::unique_ptr<SSTableIterator>> iterators;
+    uint64_t total_entries = 0;
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < files.size(); i++)
     {
-        if (std::get<0>(a) != std::get<0>(b))
+        std::shared_ptr<SSTable> sst = table_cache->find(*files[i]);
+        if (!sst)
         {
-            return std::get<0>(a) > std::get<0>(b);
+            return false;
         }
-        return std::get<3>(a) > std::get<3>(b);
-    };
-    std::priority_queue<HeapEntry, std::vector<HeapEntry>, decltype(cmp)> heap(cmp);
+        size_t order = files.size() - 1 - i;
+        iterators.push_back(std::make_unique<SSTableIterator>(sst.get(), order, AccessPattern::Sequential));
+        sstables.push_back(std::move(sst));
+        total_entries += files[i]->num_entries;
+        total_bytes += files[i]->file_size;
+    }
+
+    // Filters are sized before the output entry count is known, so estimate
+    // it from the average input record size.
+    uint64_t expected_entries = total_entries;
+    if (total_bytes > MAX_SSTABLE_FILE_SIZE)
+    {
+        expected_entries = std::min(total_entries, MAX_SSTABLE_FILE_SIZE * total_entries / total_bytes + 1);
+    }
+
+    std::priority_queue<MergeEntry, std::vector<MergeEntry>, MergeEntryGreater> heap;
 
     for (size_t i = 0; i < iterators.size(); i++)
     {
@@ -258,61 +1421,211 @@ std::unique_ptr<SSTable> LSMTree::merge_sstables(const std::vector<std::unique_p
         }
     }
 
-    std::vector<std::pair<std::string, std::string>> merged_data;
-
-    while (!heap.empty())
+    struct Output
     {
-        auto [key, value, iterator_idx, file_order] = heap.top();
-        heap.pop();
+        uint64_t number;
+        size_t num_tombstones;
+        std::shared_ptr<SSTable> table;
+    };
+    std::vector<Output> tables;
+    std::unique_ptr<SSTableBuilder> builder;
+    uint64_t number = 0;
+    size_t num_tombstones = 0;
+    size_t unique_keys = 0;
+    size_t dropped = 0;
+    bool ok = true;
 
-        std::string current_key = key;
-        std::string latest_value = value;
-        size_t latest_order = file_order;
+    auto finish_output = [&]()
+    {
+        std::shared_ptr<SSTable> sst(builder->finish());
+        builder.reset();
+        if (!sst)
+        {
+            return false;
+        }
+        tables.push_back({number, num_tombstones, std::move(sst)});
+        return true;
+    };
 
+    std::vector<std::pair<std::string, std::string>> versions;
+    while (!heap.empty())
+    {
+        versions.clear();
+        std::string current_key = std::get<0>(heap.top());
         while (!heap.empty() && std::get<0>(heap.top()) == current_key)
         {
-            auto [dup_key, dup_value, dup_iterator_idx, dup_order] = heap.top();
+            auto [key, value, iterator_idx, file_order] = heap.top();
             heap.pop();
+            versions.emplace_back(std::move(key), std::move(value));
 
-            if (dup_order < latest_order)
+            if (iterators[iterator_idx]->has_next())
             {
-                latest_value = dup_value;
-                latest_order = dup_order;
+                auto [next_key, next_value] = iterators[iterator_idx]->next();
+                heap.push({next_key, next_value, iterator_idx, iterators[iterator_idx]->get_order()});
             }
+        }
+
+        size_t num_versions = versions.size();
+        drop_hidden_versions(versions, snapshots, drop_tombstones);
+        dropped += num_versions - versions.size();
+        if (versions.empty())
+        {
+            continue;
+        }
 
-            if (iterators[dup_iterator_idx]->has_next())
+        if (!builder)
+        {
+            number = new_file_number();
+            num_tombstones = 0;
+            builder.reset(SSTableBuilder::create(make_filename("sst", number, ".sst"), expected_entries,
+                                                 options_for_tier(number, output_tier)));
+            if (!builder)
             {
-                auto [next_key, next_value] = iterators[dup_iterator_idx]->next();
-                heap.push({next_key, next_value, dup_iterator_idx, iterators[dup_iterator_idx]->get_order()});
+                ok = false;
+                break;
             }
         }
 
-        merged_data.push_back({current_key, latest_value});
-
-        if (iterators[iterator_idx]->has_next())
+        for (const auto &[key, value] : versions)
+        {
+            builder->add(key, value);
+            num_tombstones += value_type(value) == ValueType::Deletion;
+        }
+        unique_keys++;
+        if (builder->get_file_size() >= MAX_SSTABLE_FILE_SIZE && !finish_output())
         {
-            auto [next_key, next_value] = iterators[iterator_idx]->next();
-            heap.push({next_key, next_value, iterator_idx, iterators[iterator_idx]->get_order()});
+            ok = false;
+            break;
         }
     }
 
-    LOG_DEBUG("Total unique keys after merge: %zu", merged_data.size());
+    if (ok && builder && !finish_output())
+    {
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        for (const auto &output : tables)
+        {
+            std::filesystem::remove(output.table->get_filename());
+        }
+        return false;
+    }
 
-    std::unique_ptr<SSTable> merged(SSTable::create_from_sorted_data(new_filename, merged_data));
-    LOG_DEBUG("Created merged SSTable: %s", new_filename.c_str());
+    LOG_DEBUG("Total unique keys after merge: %zu in %zu files, %zu versions dropped", unique_keys, tables.size(), dropped);
 
-    return merged;
+    uint64_t run = tables.empty() ? 0 : tables.front().number;
+    for (auto &output : tables)
+    {
+        LOG_DEBUG("Created merged SSTable: %s", output.table->get_filename().c_str());
+        outputs.push_back(add_table_file(output.number, run, output.num_tombstones, std::move(output.table)));
+    }
+    return true;
 }
 
 int LSMTree::get_tier_count() const
 {
+    std::lock_guard<std::mutex> lock(mutex);
     return tiers.size();
 }
 
-std::string LSMTree::generate_sstable_filename() const
+size_t LSMTree::get_file_count(int tier) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return tier < static_cast<int>(tiers.size()) ? tiers[tier].size() : 0;
+}
+
+size_t LSMTree::get_run_count(int tier) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return tier < static_cast<int>(tiers.size()) ? count_runs(tiers[tier]) : 0;
+}
+
+std::vector<std::pair<std::string, std::string>> LSMTree::get_key_ranges(int tier) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::pair<std::string, std::string>> ranges;
+    if (tier < static_cast<int>(tiers.size()))
+    {
+        for (const auto &file : tiers[tier])
+        {
+            ranges.emplace_back(file->smallest, file->largest);
+        }
+    }
+    return ranges;
+}
+
+size_t LSMTree::get_immutable_count() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return immutables.size();
+}
+
+const TableCache &LSMTree::get_table_cache() const
+{
+    return *table_cache;
+}
+
+const BlockCache *LSMTree::get_block_cache() const
+{
+    return block_cache.get();
+}
+
+CompressionStats LSMTree::get_compression_stats() const
+{
+    return compression_stats.get_stats();
+}
+
+SSTableOptions LSMTree::options_for_tier(uint64_t number, int tier) const
+{
+    SSTableOptions table_options = table_cache->options_for(number);
+    const std::vector<CompressionType> &codecs = options.compression_per_tier;
+    if (!codecs.empty())
+    {
+        table_options.compression = codecs[std::min<size_t>(tier, codecs.size() - 1)];
+    }
+    return table_options;
+}
+
+std::shared_ptr<FileMeta> LSMTree::write_sstable(uint64_t number, const std::vector<std::pair<std::string, std::string>> &data)
+{
+    std::string filename = make_filename("sst", number, ".sst");
+
+    std::shared_ptr<SSTable> sst(SSTable::create_from_sorted_data(filename, data, options_for_tier(number, 0)));
+    if (!sst)
+    {
+        return nullptr;
+    }
+    size_t num_tombstones = std::count_if(data.begin(), data.end(), [](const std::pair<std::string, std::string> &entry)
+                                          { return value_type(entry.second) == ValueType::Deletion; });
+    return add_table_file(number, number, num_tombstones, std::move(sst));
+}
+
+std::shared_ptr<FileMeta> LSMTree::add_table_file(uint64_t number, uint64_t run, size_t num_tombstones, std::shared_ptr<SSTable> sst)
+{
+    auto file = std::make_shared<FileMeta>();
+    file->number = number;
+    file->filename = sst->get_filename();
+    file->file_size = std::filesystem::file_size(file->filename);
+    file->num_entries = sst->get_num_entries();
+    file->run = run;
+    file->num_tombstones = num_tombstones;
+    file->smallest = sst->get_smallest_key();
+    file->largest = sst->get_largest_key();
+    table_cache->insert(*file, std::move(sst));
+    return file;
+}
+
+uint64_t LSMTree::new_file_number()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return next_file_number++;
+}
+
+std::string LSMTree::make_filename(const char *prefix, uint64_t number, const char *suffix) const
 {
-    auto timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
-                         std::chrono::system_clock::now().time_since_epoch())
-                         .count();
-    return data_dir + "/sst_" + std::to_string(timestamp) + ".sst";
+    char name[64];
+    snprintf(name, sizeof(name), "/%s_%06llu%s", prefix, static_cast<unsigned long long>(number), suffix);
+    return data_dir + name;
 }
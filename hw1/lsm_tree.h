@@ -2,32 +2,248 @@
 
 #include "memtable.h"
 #include "sstable.h"
+#include "table_cache.h"
+#include "wal.h"
+#include "manifest.h"
 
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <queue>
+#include <tuple>
+
+// Tiered merges whole tiers into the next one and suits write-heavy loads.
+// Leveled keeps every level below 0 as one sorted run of non-overlapping
+// files under a size target and compacts it a file at a time, so a lookup
+// reads at most one file per level.
+enum class CompactionStyle
+{
+    Tiered,
+    Leveled
+};
+
+struct LSMOptions
+{
+    size_t max_open_files = 1000;
+    bool use_mmap = false;
+    size_t block_cache_capacity = 8 * 1024 * 1024;
+    bool pin_index_and_filter_blocks = false;
+    bool enable_wal = true;
+    WALSyncMode wal_sync_mode = WALSyncMode::None;
+    size_t max_immutable_memtables = 2;
+    size_t compaction_threads = 2;
+    double bloom_bits_per_key = BLOOM_DEFAULT_BITS_PER_KEY;
+    // When set, overrides bloom_bits_per_key with the size for this rate.
+    double bloom_false_positive_rate = 0;
+    BloomFilterType bloom_filter_type = BloomFilterType::Blocked;
+    CompactionStyle compaction_style = CompactionStyle::Tiered;
+    // Codec for tables written to each tier; deeper tiers use the last one.
+    // Tier 0 takes every flush, so it gets the fast codec. Empty disables
+    // compression.
+    std::vector<CompressionType> compression_per_tier = {CompressionType::LZFast, CompressionType::LZHigh};
+};
+
+struct ImmutableMemTable
+{
+    std::shared_ptr<MemTable> table;
+    uint64_t log_number;
+    // Logs holding the table's writes, deleted once its flush is recorded.
+    // A table rebuilt on recovery may come from several.
+    std::vector<std::string> log_files;
+};
+
+// Read view of the tree published after every flush, memtable switch and
+// compaction. Readers pin one with a shared_ptr and never take the tree lock.
+struct Version
+{
+    std::shared_ptr<MemTable> memtable;
+    std::vector<std::shared_ptr<MemTable>> immutables;
+    Tiers tiers;
+};
+
+// Heap order when merging sources: by key, then newest sequence number
+// first. Records from before sequence numbers all carry 0; among those the
+// newer source (lower order) wins. Entries are (key, tagged value, source,
+// order).
+using MergeEntry = std::tuple<std::string, std::string, size_t, size_t>;
+
+struct MergeEntryGreater
+{
+    bool operator()(const MergeEntry &a, const MergeEntry &b) const
+    {
+        int cmp = std::get<0>(a).compare(std::get<0>(b));
+        if (cmp != 0)
+        {
+            return cmp > 0;
+        }
+        uint64_t sequence_a = value_sequence(std::get<1>(a));
+        uint64_t sequence_b = value_sequence(std::get<1>(b));
+        if (sequence_a != sequence_b)
+        {
+            return sequence_a < sequence_b;
+        }
+        return std::get<3>(a) > std::get<3>(b);
+    }
+};
+
+// A consistent read point: reads given a snapshot ignore every write made
+// after it was taken, and compaction keeps the versions it can see until
+// it is released.
+class Snapshot
+{
+private:
+    uint64_t sequence;
+
+    explicit Snapshot(uint64_t seq) : sequence(seq) {}
+    friend class LSMTree;
+
+public:
+    uint64_t get_sequence() const { return sequence; }
+};
 
 class LSMTree
 {
 private:
-    std::unique_ptr<MemTable> memtable;
-    std::vector<std::vector<std::unique_ptr<SSTable>>> tiers;
+    std::shared_ptr<MemTable> memtable;
+    std::deque<ImmutableMemTable> immutables;
+    Tiers tiers;
     std::string data_dir;
+    uint64_t next_file_number;
+    uint64_t log_number;
+    // Published: every write up to it is in the memtable and visible.
+    std::atomic<uint64_t> last_sequence;
+    // Assigned to writes still being logged or inserted.
+    uint64_t next_sequence;
+    // Inserted writes, by first sequence, waiting for earlier ones to be
+    // published.
+    std::map<uint64_t, uint64_t> completed_writes;
+    size_t pending_switches;
+    std::multiset<uint64_t> snapshots;
+    LSMOptions options;
+    std::unique_ptr<BlockCache> block_cache;
+    CompressionCounters compression_stats;
+    std::unique_ptr<TableCache> table_cache;
+    std::shared_ptr<WriteAheadLog> wal;
+    std::unique_ptr<Manifest> manifest;
+    std::shared_ptr<const Version> current;
+    std::vector<std::shared_ptr<FileMeta>> obsolete_files;
+
+    mutable std::mutex mutex;
+    std::condition_variable background_cv;
+    std::condition_variable flush_done_cv;
+    std::condition_variable write_cv;
+    std::thread flush_thread;
+    std::condition_variable compaction_cv;
+    std::vector<std::thread> compaction_workers;
+    std::set<int> busy_tiers;
+    size_t running_compactions;
+    bool shutting_down;
 
-    void flush_memtable();
-    void compact_tier(int tier);
-    std::unique_ptr<SSTable> merge_sstables(const std::vector<std::unique_ptr<SSTable>> &sstables, const std::string &new_filename);
-    std::string generate_sstable_filename() const;
+    void recover();
+    void replay_log(const std::string &log);
+    void delete_obsolete_files();
+    void log_and_apply(const VersionEdit &edit);
+    void new_wal();
+    void install_version();
+    std::shared_ptr<const Version> get_version() const;
+    uint64_t read_sequence(const Snapshot *snapshot) const;
+    std::vector<uint64_t> live_snapshots() const;
+    void purge_obsolete_files();
+    void make_room_for_write(std::unique_lock<std::mutex> &lock);
+    void publish_write(std::unique_lock<std::mutex> &lock, uint64_t first, uint64_t last);
+    void switch_memtable();
+    void background_flush();
+    bool flush_immutable(std::unique_lock<std::mutex> &lock);
+    void background_compaction();
+    int pick_compaction() const;
+    double compaction_score(int tier) const;
+    bool is_bottom(int tier) const;
+    void pick_level_inputs(int level, std::vector<std::shared_ptr<FileMeta>> &inputs,
+                           std::vector<std::shared_ptr<FileMeta>> &next_inputs) const;
+    bool compact_tier(int tier, std::unique_lock<std::mutex> &lock);
+    void move_file(int tier, const std::shared_ptr<FileMeta> &file);
+    bool merge_sstables(const std::vector<std::shared_ptr<FileMeta>> &files, const std::vector<uint64_t> &snapshots,
+                        bool drop_tombstones, int output_tier, std::vector<std::shared_ptr<FileMeta>> &outputs);
+    std::shared_ptr<FileMeta> write_sstable(uint64_t number, const std::vector<std::pair<std::string, std::string>> &data);
+    std::shared_ptr<FileMeta> add_table_file(uint64_t number, uint64_t run, size_t num_tombstones, std::shared_ptr<SSTable> sst);
+    void load_key_range(FileMeta &file);
+    void add_existing_table(uint64_t number);
+    SSTableOptions options_for_tier(uint64_t number, int tier) const;
+    uint64_t new_file_number();
+    std::string make_filename(const char *prefix, uint64_t number, const char *suffix) const;
 
 public:
-    LSMTree(const std::string &dir = "data");
+    LSMTree(const std::string &dir = "data", const LSMOptions &opts = LSMOptions());
     ~LSMTree();
     void put(const std::string &key, const std::string &value);
-    std::string get(const std::string &key);
+    std::string get(const std::string &key, const Snapshot *snapshot = nullptr);
+    std::vector<std::string> multi_get(const std::vector<std::string> &keys, const Snapshot *snapshot = nullptr);
     void remove(const std::string &key);
-    std::vector<std::pair<std::string, std::string>> scan(const std::string &start, const std::string &end, int limit = 1000);
+    void write(const WriteBatch &batch);
+    std::vector<std::pair<std::string, std::string>> scan(const std::string &start, const std::string &end, int limit = 1000,
+                                                          const Snapshot *snapshot = nullptr);
+    class Iterator;
+    // Starts unpositioned; call seek() or seek_to_first() first.
+    std::unique_ptr<Iterator> new_iterator(const Snapshot *snapshot = nullptr);
+    const Snapshot *get_snapshot();
+    void release_snapshot(const Snapshot *snapshot);
     void print_stats() const;
     void manual_flush();
+    void wait_for_compactions();
     int get_tier_count() const;
+    size_t get_file_count(int tier) const;
+    size_t get_run_count(int tier) const;
+    std::vector<std::pair<std::string, std::string>> get_key_ranges(int tier) const;
+    size_t get_immutable_count() const;
+    const TableCache &get_table_cache() const;
+    const BlockCache *get_block_cache() const;
+    CompressionStats get_compression_stats() const;
+};
+
+// Merges the memtables and tables of one Version lazily: seek() positions
+// each source through its index, and next() reads only as far as the
+// caller goes. Deleted keys and versions newer than the read sequence are
+// skipped. Holding the Version keeps its files alive, but the iterator must
+// not outlive the tree.
+class LSMTree::Iterator
+{
+private:
+    std::shared_ptr<const Version> version;
+    TableCache *table_cache;
+    uint64_t sequence;
+    // Sources are the tables, newest first, then the memtables, newest
+    // first. Tables are opened on the first seek that reaches them.
+    std::vector<const FileMeta *> files;
+    std::vector<std::shared_ptr<SSTable>> tables;
+    std::vector<std::unique_ptr<SSTableIterator>> table_iterators;
+    std::vector<MemTable::Iterator> memtable_iterators;
+    std::priority_queue<MergeEntry, std::vector<MergeEntry>, MergeEntryGreater> heap;
+    std::string upper_bound;
+    bool has_upper_bound;
+    std::string current_key;
+    std::string current_value;
+    bool is_valid;
+
+    Iterator(std::shared_ptr<const Version> v, TableCache *cache, uint64_t seq);
+    void push_next(size_t source);
+    void find_visible();
+    friend class LSMTree;
+
+public:
+    // Keys above it are never returned, and tables starting after it are
+    // not opened. Takes effect at the next seek.
+    void set_upper_bound(const std::string &key);
+    bool valid() const;
+    void seek_to_first();
+    void seek(const std::string &target);
+    void next();
+    const std::string &key() const;
+    const std::string &value() const;
 };
@@ -4,6 +4,9 @@
 #include <chrono>
 #include <filesystem>
 #include <random>
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 class Benchmark
 {
@@ -70,6 +73,53 @@ public:
         LOG_INFO("  Ops/sec: %.2f", (num_ops * 1000.0 / duration.count()));
     }
 
+    void bench_multi_get(int num_ops, int batch_size)
+    {
+        LOG_INFO("Running multi_get benchmark for %d keys in batches of %d...", num_ops, batch_size);
+
+        for (int i = 0; i < num_ops; i++)
+        {
+            lsm.put("key_" + std::to_string(i), "value_" + std::to_string(i));
+        }
+        lsm.manual_flush();
+        lsm.wait_for_compactions();
+
+        std::mt19937 gen(42);
+        std::uniform_int_distribution<> key_dist(0, num_ops * 2);
+        std::vector<std::string> keys;
+        for (int i = 0; i < num_ops; i++)
+        {
+            keys.push_back("key_" + std::to_string(key_dist(gen)));
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        int found = 0;
+        for (const auto &key : keys)
+        {
+            found += !lsm.get(key).empty();
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        auto single = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+        start = std::chrono::high_resolution_clock::now();
+        int batch_found = 0;
+        for (size_t i = 0; i < keys.size(); i += batch_size)
+        {
+            std::vector<std::string> batch(keys.begin() + i, keys.begin() + std::min(keys.size(), i + batch_size));
+            for (const auto &value : lsm.multi_get(batch))
+            {
+                batch_found += !value.empty();
+            }
+        }
+        end = std::chrono::high_resolution_clock::now();
+        auto batched = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+        LOG_INFO("Multi-get benchmark completed:");
+        LOG_INFO("  Found: %d single, %d batched", found, batch_found);
+        LOG_INFO("  get:       %lld ms", single.count());
+        LOG_INFO("  multi_get: %lld ms", batched.count());
+    }
+
     void bench_scan(int num_ranges, int range_size)
     {
         LOG_INFO("Running scan benchmark for %d ranges of size %d...", num_ranges, range_size);
@@ -110,6 +160,53 @@ public:
         }
     }
 
+    void bench_concurrent(int num_ops, int max_threads, int key_space = 10000)
+    {
+        LOG_INFO("Running concurrent benchmark for %d operations (90%% get, 10%% put) on up to %d threads...", num_ops, max_threads);
+
+        for (int i = 0; i < key_space; i++)
+        {
+            lsm.put("key_" + std::to_string(i), "value_" + std::to_string(i));
+        }
+        lsm.manual_flush();
+
+        for (int threads = 1; threads <= max_threads; threads *= 2)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+
+            std::vector<std::thread> workers;
+            for (int t = 0; t < threads; t++)
+            {
+                workers.emplace_back([this, t, threads, num_ops, key_space]()
+                                     {
+                    std::mt19937 gen(t);
+                    std::uniform_int_distribution<> op_dist(0, 9);
+                    std::uniform_int_distribution<> key_dist(0, key_space - 1);
+                    for (int i = t; i < num_ops; i += threads)
+                    {
+                        std::string key = "key_" + std::to_string(key_dist(gen));
+                        if (op_dist(gen) == 0)
+                        {
+                            lsm.put(key, "value_" + std::to_string(i));
+                        }
+                        else
+                        {
+                            lsm.get(key);
+                        }
+                    } });
+            }
+            for (auto &worker : workers)
+            {
+                worker.join();
+            }
+
+            auto end = std::chrono::high_resolution_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+            LOG_INFO("  %2d threads: %lld ms, %.2f ops/sec", threads, duration.count(),
+                     duration.count() > 0 ? num_ops * 1000.0 / duration.count() : 0.0);
+        }
+    }
+
     void bench_random_operations(int num_ops, int seed = 42, int max_key = 100, const std::string &output_file = "stats.csv")
     {
         LOG_INFO("Running random operations benchmark for %d operations (seed: %d, max_key: %d)...", num_ops, seed, max_key);
@@ -182,8 +279,105 @@ public:
     }
 };
 
+static void bench_bloom(int num_keys, double bits_per_key)
+{
+    LOG_INFO("Running bloom filter benchmark for %d keys at %.1f bits/key (blocked probe: %s)...",
+             num_keys, bits_per_key, BloomFilter::get_simd_level());
+
+    std::vector<std::string> keys;
+    std::vector<std::string> missing;
+    for (int i = 0; i < num_keys; i++)
+    {
+        keys.push_back("key_" + std::to_string(i));
+        missing.push_back("missing_" + std::to_string(i));
+    }
+
+    for (BloomFilterType type : {BloomFilterType::Standard, BloomFilterType::Blocked})
+    {
+        BloomFilter filter(keys.size(), bits_per_key, type);
+        for (const auto &key : keys)
+        {
+            filter.add(key);
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        int false_positives = 0;
+        for (const auto &key : missing)
+        {
+            false_positives += filter.might_contain(key);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+
+        LOG_INFO("  %s: %zu bits, %d hashes, %.1f ns/negative probe, false positive rate %.4f",
+                 type == BloomFilterType::Blocked ? "blocked " : "standard", filter.get_num_bits(), filter.get_num_hashes(),
+                 duration.count() / static_cast<double>(num_keys), false_positives / static_cast<double>(num_keys));
+    }
+}
+
 int main(int argc, char *argv[])
 {
+    LSMOptions options;
+    std::vector<char *> args;
+    for (int i = 0; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--mmap")
+        {
+            options.use_mmap = true;
+        }
+        else if (arg == "--wal=off")
+        {
+            options.enable_wal = false;
+        }
+        else if (arg == "--wal=none")
+        {
+            options.wal_sync_mode = WALSyncMode::None;
+        }
+        else if (arg == "--wal=fsync")
+        {
+            options.wal_sync_mode = WALSyncMode::PerWrite;
+        }
+        else if (arg == "--wal=group")
+        {
+            options.wal_sync_mode = WALSyncMode::GroupCommit;
+        }
+        else if (arg == "--bloom=standard")
+        {
+            options.bloom_filter_type = BloomFilterType::Standard;
+        }
+        else if (arg == "--bloom=blocked")
+        {
+            options.bloom_filter_type = BloomFilterType::Blocked;
+        }
+        else if (arg == "--compaction=tiered")
+        {
+            options.compaction_style = CompactionStyle::Tiered;
+        }
+        else if (arg == "--compaction=leveled")
+        {
+            options.compaction_style = CompactionStyle::Leveled;
+        }
+        else if (arg == "--compression=none")
+        {
+            options.compression_per_tier.clear();
+        }
+        else if (arg == "--compression=fast")
+        {
+            options.compression_per_tier = {CompressionType::LZFast};
+        }
+        else if (arg == "--compression=tiered")
+        {
+            options.compression_per_tier = {CompressionType::LZFast, CompressionType::LZHigh};
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+    argc = args.size();
+    argv = args.data();
+
     std::string mode;
     if (argc > 1)
     {
@@ -198,7 +392,7 @@ int main(int argc, char *argv[])
         std::string output_file = (argc > 5) ? argv[5] : "stats.csv";
 
         std::filesystem::remove_all("data");
-        LSMTree lsm("data");
+        LSMTree lsm("data", options);
         Benchmark bench(lsm);
         bench.bench_random_operations(num_ops, seed, max_key, output_file);
     }
@@ -206,7 +400,7 @@ int main(int argc, char *argv[])
     {
         int num_ops = std::stoi(argv[2]);
         std::filesystem::remove_all("data");
-        LSMTree lsm("data");
+        LSMTree lsm("data", options);
         Benchmark bench(lsm);
         bench.bench_insert(num_ops);
     }
@@ -214,26 +408,59 @@ int main(int argc, char *argv[])
     {
         int num_ops = std::stoi(argv[2]);
         std::filesystem::remove_all("data");
-        LSMTree lsm("data");
+        LSMTree lsm("data", options);
         Benchmark bench(lsm);
         bench.bench_get(num_ops);
     }
+    else if (mode == "--bench-multiget" && argc > 2)
+    {
+        int num_ops = std::stoi(argv[2]);
+        int batch_size = (argc > 3) ? std::stoi(argv[3]) : 100;
+        std::filesystem::remove_all("data");
+        LSMTree lsm("data", options);
+        Benchmark bench(lsm);
+        bench.bench_multi_get(num_ops, batch_size);
+    }
     else if (mode == "--bench-scan" && argc > 3)
     {
         int num_ranges = std::stoi(argv[2]);
         int range_size = std::stoi(argv[3]);
         std::filesystem::remove_all("data");
-        LSMTree lsm("data");
+        LSMTree lsm("data", options);
         Benchmark bench(lsm);
         bench.bench_scan(num_ranges, range_size);
     }
+    else if (mode == "--bench-threads" && argc > 2)
+    {
+        int num_ops = std::stoi(argv[2]);
+        int max_threads = (argc > 3) ? std::stoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+        std::filesystem::remove_all("data");
+        LSMTree lsm("data", options);
+        Benchmark bench(lsm);
+        bench.bench_concurrent(num_ops, max_threads);
+    }
+    else if (mode == "--bench-bloom" && argc > 2)
+    {
+        int num_keys = std::stoi(argv[2]);
+        double bits_per_key = (argc > 3) ? std::stod(argv[3]) : BLOOM_DEFAULT_BITS_PER_KEY;
+        bench_bloom(num_keys, bits_per_key);
+    }
     else
     {
         LOG_INFO("Usage:");
         LOG_INFO("  %s --bench-random <num_ops> [seed] [max_key] [output_file]", argv[0]);
         LOG_INFO("  %s --bench-insert <num_ops>", argv[0]);
         LOG_INFO("  %s --bench-get <num_ops>", argv[0]);
+        LOG_INFO("  %s --bench-multiget <num_ops> [batch_size]", argv[0]);
         LOG_INFO("  %s --bench-scan <num_ranges> <range_size>", argv[0]);
+        LOG_INFO("  %s --bench-threads <num_ops> [max_threads]", argv[0]);
+        LOG_INFO("  %s --bench-bloom <num_keys> [bits_per_key]", argv[0]);
+        LOG_INFO("Options:");
+        LOG_INFO("  --mmap    read SSTables through mmap instead of pread");
+        LOG_INFO("  --wal=off|none|fsync|group    WAL sync mode (default: none)");
+        LOG_INFO("  --bloom=standard|blocked    SSTable bloom filter layout (default: blocked)");
+        LOG_INFO("  --compaction=tiered|leveled    compaction strategy (default: tiered)");
+        LOG_INFO("  --compression=none|fast|tiered    block codec; tiered uses lz-high below tier 0 (default: tiered)");
     }
 
     return 0;
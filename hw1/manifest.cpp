@@ -0,0 +1,325 @@
+#include "manifest.h"
+#include "utils.h"
+
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstdio>
+
+enum EditTag : uint8_t
+{
+    TAG_LOG_NUMBER = 1,
+    TAG_NEXT_FILE_NUMBER = 2,
+    TAG_ADD_FILE = 3,
+    TAG_DELETE_FILE = 4,
+    TAG_LAST_SEQUENCE = 5
+};
+
+// [u32 size][smallest][u32 size][largest], appended to file records after
+// num_tombstones. Older records leave both keys empty.
+static bool decode_key_range(std::string_view src, FileMeta &file)
+{
+    std::string *keys[] = {&file.smallest, &file.largest};
+    for (std::string *key : keys)
+    {
+        if (src.size() < sizeof(uint32_t))
+        {
+            return false;
+        }
+        uint32_t size = decode_uint32(src.data());
+        src.remove_prefix(sizeof(uint32_t));
+        if (src.size() < size)
+        {
+            return false;
+        }
+        key->assign(src.data(), size);
+        src.remove_prefix(size);
+    }
+    return true;
+}
+
+void VersionEdit::set_log_number(uint64_t number)
+{
+    has_log_number = true;
+    log_number = number;
+}
+
+void VersionEdit::set_next_file_number(uint64_t number)
+{
+    has_next_file_number = true;
+    next_file_number = number;
+}
+
+void VersionEdit::set_last_sequence(uint64_t sequence)
+{
+    has_last_sequence = true;
+    last_sequence = sequence;
+}
+
+void VersionEdit::add_file(int tier, const FileMeta &file)
+{
+    added_files.emplace_back(tier, file);
+}
+
+void VersionEdit::delete_file(int tier, uint64_t number)
+{
+    deleted_files.emplace_back(tier, number);
+}
+
+void VersionEdit::encode(std::string &dst) const
+{
+    if (has_log_number)
+    {
+        dst.push_back(TAG_LOG_NUMBER);
+        put_uint64(dst, log_number);
+    }
+    if (has_next_file_number)
+    {
+        dst.push_back(TAG_NEXT_FILE_NUMBER);
+        put_uint64(dst, next_file_number);
+    }
+    if (has_last_sequence)
+    {
+        dst.push_back(TAG_LAST_SEQUENCE);
+        put_uint64(dst, last_sequence);
+    }
+    for (const auto &[tier, number] : deleted_files)
+    {
+        dst.push_back(TAG_DELETE_FILE);
+        put_uint32(dst, tier);
+        put_uint64(dst, number);
+    }
+    for (const auto &[tier, file] : added_files)
+    {
+        // File records are length-prefixed so new fields can be appended
+        // without breaking older manifests.
+        std::string record;
+        put_uint64(record, file.number);
+        put_uint64(record, file.file_size);
+        put_uint64(record, file.num_entries);
+        put_uint64(record, file.run);
+        put_uint64(record, file.num_tombstones);
+        put_uint32(record, file.smallest.size());
+        record.append(file.smallest);
+        put_uint32(record, file.largest.size());
+        record.append(file.largest);
+
+        dst.push_back(TAG_ADD_FILE);
+        put_uint32(dst, tier);
+        put_uint32(dst, record.size());
+        dst.append(record);
+    }
+}
+
+bool VersionEdit::decode(std::string_view src)
+{
+    size_t pos = 0;
+    auto need = [&](size_t n)
+    { return pos + n <= src.size(); };
+
+    while (pos < src.size())
+    {
+        uint8_t tag = src[pos++];
+        switch (tag)
+        {
+        case TAG_LOG_NUMBER:
+            if (!need(sizeof(uint64_t)))
+                return false;
+            set_log_number(decode_uint64(&src[pos]));
+            pos += sizeof(uint64_t);
+            break;
+        case TAG_NEXT_FILE_NUMBER:
+            if (!need(sizeof(uint64_t)))
+                return false;
+            set_next_file_number(decode_uint64(&src[pos]));
+            pos += sizeof(uint64_t);
+            break;
+        case TAG_LAST_SEQUENCE:
+            if (!need(sizeof(uint64_t)))
+                return false;
+            set_last_sequence(decode_uint64(&src[pos]));
+            pos += sizeof(uint64_t);
+            break;
+        case TAG_DELETE_FILE:
+            if (!need(sizeof(uint32_t) + sizeof(uint64_t)))
+                return false;
+            delete_file(decode_uint32(&src[pos]), decode_uint64(&src[pos + sizeof(uint32_t)]));
+            pos += sizeof(uint32_t) + sizeof(uint64_t);
+            break;
+        case TAG_ADD_FILE:
+        {
+            if (!need(sizeof(uint32_t) * 2))
+                return false;
+            int tier = decode_uint32(&src[pos]);
+            uint32_t length = decode_uint32(&src[pos + sizeof(uint32_t)]);
+            pos += sizeof(uint32_t) * 2;
+            if (!need(length) || length < sizeof(uint64_t) * 3)
+                return false;
+
+            FileMeta file{};
+            const char *ptr = &src[pos];
+            file.number = decode_uint64(ptr);
+            file.file_size = decode_uint64(ptr + sizeof(uint64_t));
+            file.num_entries = decode_uint64(ptr + sizeof(uint64_t) * 2);
+            file.run = length >= sizeof(uint64_t) * 4 ? decode_uint64(ptr + sizeof(uint64_t) * 3) : file.number;
+            file.num_tombstones = length >= sizeof(uint64_t) * 5 ? decode_uint64(ptr + sizeof(uint64_t) * 4) : 0;
+            if (length > sizeof(uint64_t) * 5 && !decode_key_range(std::string_view(ptr, length).substr(sizeof(uint64_t) * 5), file))
+                return false;
+            add_file(tier, file);
+            pos += length;
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+void VersionEdit::apply(Tiers &tiers) const
+{
+    for (const auto &[tier, number] : deleted_files)
+    {
+        if (tier >= static_cast<int>(tiers.size()))
+        {
+            continue;
+        }
+        auto &files = tiers[tier];
+        files.erase(std::remove_if(files.begin(), files.end(),
+                                   [number = number](const std::shared_ptr<FileMeta> &file)
+                                   { return file->number == number; }),
+                    files.end());
+    }
+    for (const auto &[tier, file] : added_files)
+    {
+        if (tier >= static_cast<int>(tiers.size()))
+        {
+            tiers.resize(tier + 1);
+        }
+        tiers[tier].push_back(std::make_shared<FileMeta>(file));
+    }
+}
+
+Manifest::Manifest(const std::string &dir) : data_dir(dir) {}
+
+const std::string &Manifest::get_filename() const
+{
+    return filename;
+}
+
+bool Manifest::recover(const std::string &dir, Tiers &tiers, uint64_t &log_number, uint64_t &next_file_number,
+                       uint64_t &last_sequence)
+{
+    std::ifstream current(dir + "/CURRENT");
+    std::string name;
+    if (!current || !std::getline(current, name) || name.empty())
+    {
+        return false;
+    }
+
+    bool ok = true;
+    size_t edits = 0;
+    bool replayed = WriteAheadLog::replay(dir + "/" + name, [&](std::string_view payload)
+                                          {
+        // Later edits build on the damaged one, so none of them apply.
+        if (!ok)
+        {
+            return;
+        }
+        VersionEdit edit;
+        if (!edit.decode(payload))
+        {
+            ok = false;
+            return;
+        }
+        edit.apply(tiers);
+        if (edit.has_log_number)
+        {
+            log_number = edit.log_number;
+        }
+        if (edit.has_next_file_number)
+        {
+            next_file_number = std::max(next_file_number, edit.next_file_number);
+        }
+        if (edit.has_last_sequence)
+        {
+            last_sequence = std::max(last_sequence, edit.last_sequence);
+        }
+        edits++; });
+
+    if (!replayed || !ok)
+    {
+        LOG_ERROR("Cannot recover manifest %s", name.c_str());
+        return false;
+    }
+
+    LOG_DEBUG("Recovered %zu version edits from %s", edits, name.c_str());
+    return true;
+}
+
+bool Manifest::create(uint64_t number, const Tiers &tiers, uint64_t log_number, uint64_t next_file_number,
+                      uint64_t last_sequence)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "MANIFEST-%06llu", static_cast<unsigned long long>(number));
+
+    VersionEdit snapshot;
+    snapshot.set_log_number(log_number);
+    snapshot.set_next_file_number(next_file_number);
+    snapshot.set_last_sequence(last_sequence);
+    for (size_t t = 0; t < tiers.size(); t++)
+    {
+        for (const auto &file : tiers[t])
+        {
+            snapshot.add_file(t, *file);
+        }
+    }
+
+    auto new_log = std::make_unique<WriteAheadLog>(data_dir + "/" + name, WALSyncMode::PerWrite);
+    std::string payload;
+    snapshot.encode(payload);
+    if (!new_log->is_open() || !new_log->append(payload))
+    {
+        LOG_ERROR("Cannot write manifest %s", name);
+        return false;
+    }
+
+    std::string tmp = data_dir + "/CURRENT.tmp";
+    {
+        std::ofstream current(tmp, std::ios::trunc);
+        current << name << "\n";
+        if (!current)
+        {
+            return false;
+        }
+    }
+    sync_path(tmp);
+    std::filesystem::rename(tmp, data_dir + "/CURRENT");
+    // The rename only survives a crash once the directory is synced; until
+    // then the old manifest may still be the current one.
+    bool synced = sync_path(data_dir);
+    if (!synced)
+    {
+        LOG_ERROR("Cannot sync directory %s", data_dir.c_str());
+    }
+
+    if (synced && !filename.empty())
+    {
+        std::filesystem::remove(filename);
+    }
+    filename = data_dir + "/" + name;
+    log = std::move(new_log);
+    return synced;
+}
+
+bool Manifest::apply(const VersionEdit &edit)
+{
+    if (!log)
+    {
+        return false;
+    }
+
+    std::string payload;
+    edit.encode(payload);
+    return log->append(payload);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "table_cache.h"
+#include "wal.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+using Tiers = std::vector<std::vector<std::shared_ptr<FileMeta>>>;
+
+// One atomic change to the tier layout. Files are appended to the end of
+// their tier, so replaying edits in order reproduces the file order.
+struct VersionEdit
+{
+    bool has_log_number = false;
+    uint64_t log_number = 0;
+    bool has_next_file_number = false;
+    uint64_t next_file_number = 0;
+    bool has_last_sequence = false;
+    uint64_t last_sequence = 0;
+    std::vector<std::pair<int, FileMeta>> added_files;
+    std::vector<std::pair<int, uint64_t>> deleted_files;
+
+    void set_log_number(uint64_t number);
+    void set_next_file_number(uint64_t number);
+    void set_last_sequence(uint64_t sequence);
+    void add_file(int tier, const FileMeta &file);
+    void delete_file(int tier, uint64_t number);
+
+    void encode(std::string &dst) const;
+    bool decode(std::string_view src);
+    void apply(Tiers &tiers) const;
+};
+
+// Append-only log of VersionEdits. CURRENT names the live MANIFEST-<n>
+// file and is replaced atomically with rename() when a new manifest is
+// started from a full snapshot.
+class Manifest
+{
+private:
+    std::string data_dir;
+    std::string filename;
+    std::unique_ptr<WriteAheadLog> log;
+
+public:
+    Manifest(const std::string &dir);
+    // Rebuilds tiers from the manifest CURRENT names. Returns false if there
+    // is no CURRENT or the manifest is damaged; tiers then hold the edits
+    // before the damaged one.
+    static bool recover(const std::string &dir, Tiers &tiers, uint64_t &log_number, uint64_t &next_file_number,
+                        uint64_t &last_sequence);
+    bool create(uint64_t number, const Tiers &tiers, uint64_t log_number, uint64_t next_file_number,
+                uint64_t last_sequence);
+    bool apply(const VersionEdit &edit);
+    const std::string &get_filename() const;
+};
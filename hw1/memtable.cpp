@@ -1,45 +1,181 @@
 #include "memtable.h"
 
+#include "utils.h"
+
+#include <cstring>
+#include <new>
+#include <random>
+
 #ifdef TEST_SMALL_SIZE
 const size_t MEMTABLE_SIZE_LIMIT = 256;
 #else
 const size_t MEMTABLE_SIZE_LIMIT = 4 * 1024 * 1024;
 #endif
+const int MEMTABLE_BRANCHING = 4;
 
-MemTable::MemTable() : size_bytes(0) {}
+MemTable::MemTable() : head(nullptr), max_height(1), size_bytes(0)
+{
+    head = new_node("", MAX_SEQUENCE_NUMBER, MAX_HEIGHT);
+}
 
-void MemTable::put(const std::string &key, const std::string &value)
+MemTable::Node *MemTable::new_node(std::string_view key, uint64_t sequence, int height)
 {
-    auto it = data.find(key);
-    if (it != data.end())
+    size_t node_size = sizeof(Node) + sizeof(std::atomic<Node *>) * (height - 1);
+    char *memory = arena.allocate(node_size + key.size());
+    char *key_copy = memory + node_size;
+    memcpy(key_copy, key.data(), key.size());
+
+    Node *node = new (memory) Node;
+    node->key = key_copy;
+    node->key_size = key.size();
+    node->sequence = sequence;
+    node->value = nullptr;
+    for (int i = 0; i < height; i++)
     {
-        size_bytes -= it->second.size();
+        new (&node->next[i]) std::atomic<Node *>(nullptr);
     }
+    return node;
+}
+
+// Values are stored as [u32 size][tagged value], the size in host byte
+// order.
+const char *MemTable::new_value(ValueType type, uint64_t sequence, std::string_view value)
+{
+    uint32_t value_size = VALUE_TAG_SIZE + value.size();
+    char *memory = arena.allocate(sizeof(uint32_t) + value_size);
+    memcpy(memory, &value_size, sizeof(value_size));
+    char *tag = memory + sizeof(value_size);
+    tag[0] = static_cast<char>(type);
+    encode_uint64(tag + 1, sequence);
+    memcpy(tag + VALUE_TAG_SIZE, value.data(), value.size());
+    return memory;
+}
 
-    data[key] = value;
-    size_bytes += key.size() + value.size();
+std::string_view MemTable::decode_value(const char *value)
+{
+    uint32_t value_size;
+    memcpy(&value_size, value, sizeof(value_size));
+    return std::string_view(value + sizeof(value_size), value_size);
 }
 
-bool MemTable::get(const std::string &key, std::string &value) const
+int MemTable::random_height()
 {
-    auto it = data.find(key);
-    if (it != data.end())
+    thread_local std::minstd_rand gen(std::random_device{}());
+    int height = 1;
+    while (height < MAX_HEIGHT && gen() % MEMTABLE_BRANCHING == 0)
     {
-        value = it->second;
-        return true;
+        height++;
     }
-    return false;
+    return height;
 }
 
-std::vector<std::pair<std::string, std::string>> MemTable::scan(const std::string &start, const std::string &end, int limit) const
+// Nodes are ordered by key, then by sequence number descending.
+bool MemTable::is_before(const Node *node, std::string_view key, uint64_t sequence)
 {
-    std::vector<std::pair<std::string, std::string>> result;
-    auto it = data.lower_bound(start);
+    int cmp = node->get_key().compare(key);
+    return cmp < 0 || (cmp == 0 && node->sequence > sequence);
+}
+
+void MemTable::find_splice(std::string_view key, uint64_t sequence, Node *start, int level, Node *&prev, Node *&next) const
+{
+    Node *x = start;
+    while (true)
+    {
+        Node *n = x->next[level].load(std::memory_order_acquire);
+        if (n == nullptr || !is_before(n, key, sequence))
+        {
+            prev = x;
+            next = n;
+            return;
+        }
+        x = n;
+    }
+}
+
+MemTable::Node *MemTable::find_greater_or_equal(std::string_view key, uint64_t sequence) const
+{
+    Node *x = head;
+    Node *next = nullptr;
+    for (int level = max_height.load(std::memory_order_relaxed) - 1; level >= 0; level--)
+    {
+        find_splice(key, sequence, x, level, x, next);
+    }
+    return next;
+}
+
+void MemTable::add(uint64_t sequence, ValueType type, std::string_view key, std::string_view value)
+{
+    size_bytes.fetch_add(insert(sequence, type, key, value), std::memory_order_relaxed);
+}
+
+void MemTable::apply(const WriteBatch &batch, uint64_t sequence)
+{
+    size_t delta = 0;
+    batch.iterate([this, &delta, &sequence](WALOpType type, std::string_view key, std::string_view value)
+                  { delta += insert(sequence++, type == WALOpType::Put ? ValueType::Value : ValueType::Deletion, key, value); });
+    size_bytes.fetch_add(delta, std::memory_order_relaxed);
+}
+
+size_t MemTable::insert(uint64_t sequence, ValueType type, std::string_view key, std::string_view value)
+{
+    int height = random_height();
+    int current_max = max_height.load(std::memory_order_relaxed);
+    while (height > current_max && !max_height.compare_exchange_weak(current_max, height))
+    {
+    }
 
-    while (it != data.end() && it->first <= end && result.size() < limit)
+    Node *prev[MAX_HEIGHT];
+    Node *next[MAX_HEIGHT];
+    Node *x = head;
+    for (int level = MAX_HEIGHT - 1; level >= 0; level--)
     {
-        result.push_back(*it);
-        ++it;
+        find_splice(key, sequence, x, level, prev[level], next[level]);
+        x = prev[level];
+    }
+
+    Node *node = new_node(key, sequence, height);
+    node->value = new_value(type, sequence, value);
+    for (int level = 0; level < height; level++)
+    {
+        while (true)
+        {
+            node->next[level].store(next[level], std::memory_order_relaxed);
+            if (prev[level]->next[level].compare_exchange_strong(next[level], node, std::memory_order_release))
+            {
+                break;
+            }
+
+            // Another writer linked a node here first; find the new splice.
+            find_splice(key, sequence, prev[level], level, prev[level], next[level]);
+        }
+    }
+
+    return key.size() + value.size();
+}
+
+bool MemTable::get(const std::string &key, std::string &value, uint64_t snapshot) const
+{
+    Node *node = find_greater_or_equal(key, snapshot);
+    if (node == nullptr || node->get_key() != key)
+    {
+        return false;
+    }
+    value = decode_value(node->value);
+    return true;
+}
+
+std::vector<std::pair<std::string, std::string>> MemTable::scan(const std::string &start, const std::string &end, int limit, uint64_t snapshot) const
+{
+    std::vector<std::pair<std::string, std::string>> result;
+    Node *node = find_greater_or_equal(start, MAX_SEQUENCE_NUMBER);
+    while (node != nullptr && node->get_key() <= end && result.size() < static_cast<size_t>(limit))
+    {
+        // The first version at or below the snapshot is the visible one.
+        if (node->sequence <= snapshot && (result.empty() || result.back().first != node->get_key()))
+        {
+            result.emplace_back(node->get_key(), decode_value(node->value));
+        }
+        node = node->next[0].load(std::memory_order_acquire);
     }
 
     return result;
@@ -47,21 +183,59 @@ std::vector<std::pair<std::string, std::string>> MemTable::scan(const std::strin
 
 size_t MemTable::size() const
 {
-    return size_bytes;
+    return size_bytes.load(std::memory_order_relaxed);
+}
+
+size_t MemTable::memory_usage() const
+{
+    return arena.get_memory_usage();
 }
 
 bool MemTable::should_flush() const
 {
-    return size_bytes >= MEMTABLE_SIZE_LIMIT;
+    return size() >= MEMTABLE_SIZE_LIMIT;
 }
 
 std::vector<std::pair<std::string, std::string>> MemTable::get_sorted_data() const
 {
-    return std::vector<std::pair<std::string, std::string>>(data.begin(), data.end());
+    std::vector<std::pair<std::string, std::string>> result;
+    Node *node = head->next[0].load(std::memory_order_acquire);
+    while (node != nullptr)
+    {
+        result.emplace_back(node->get_key(), decode_value(node->value));
+        node = node->next[0].load(std::memory_order_acquire);
+    }
+    return result;
+}
+
+MemTable::Iterator::Iterator(const MemTable *table) : table(table), node(nullptr) {}
+
+bool MemTable::Iterator::valid() const
+{
+    return node != nullptr;
+}
+
+void MemTable::Iterator::seek_to_first()
+{
+    node = table->head->next[0].load(std::memory_order_acquire);
+}
+
+void MemTable::Iterator::seek(std::string_view target)
+{
+    node = table->find_greater_or_equal(target, MAX_SEQUENCE_NUMBER);
+}
+
+void MemTable::Iterator::next()
+{
+    node = node->next[0].load(std::memory_order_acquire);
+}
+
+std::string_view MemTable::Iterator::key() const
+{
+    return node->get_key();
 }
 
-void MemTable::clear()
+std::string_view MemTable::Iterator::value() const
 {
-    data.clear();
-    size_bytes = 0;
+    return decode_value(node->value);
 }
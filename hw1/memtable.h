@@ -1,22 +1,86 @@
 #pragma once
 
+#include "arena.h"
+#include "write_batch.h"
+#include "utils.h"
+
 #include <string>
+#include <string_view>
 #include <vector>
-#include <map>
+#include <atomic>
 
+// Skiplist over arena-allocated nodes. Inserts link nodes with CAS, so
+// several writers can insert at once; readers never lock. Every write adds
+// a node, ordered by key and then by sequence number, newest first.
+//
+// Values are kept tagged with their ValueType and sequence number (see
+// utils.h); get(), scan() and get_sorted_data() return them tagged. Reads
+// only see entries at or below the given sequence number, so a batch being
+// applied stays invisible until the tree publishes its last sequence.
 class MemTable
 {
 private:
-    std::map<std::string, std::string> data;
-    size_t size_bytes;
+    static const int MAX_HEIGHT = 12;
+
+    struct Node
+    {
+        const char *key;
+        size_t key_size;
+        uint64_t sequence;
+        const char *value;
+        std::atomic<Node *> next[1];
+
+        std::string_view get_key() const { return std::string_view(key, key_size); }
+    };
+
+    Arena arena;
+    Node *head;
+    std::atomic<int> max_height;
+    std::atomic<size_t> size_bytes;
+
+    Node *new_node(std::string_view key, uint64_t sequence, int height);
+    const char *new_value(ValueType type, uint64_t sequence, std::string_view value);
+    static std::string_view decode_value(const char *value);
+    static int random_height();
+    static bool is_before(const Node *node, std::string_view key, uint64_t sequence);
+    void find_splice(std::string_view key, uint64_t sequence, Node *start, int level, Node *&prev, Node *&next) const;
+    Node *find_greater_or_equal(std::string_view key, uint64_t sequence) const;
+    size_t insert(uint64_t sequence, ValueType type, std::string_view key, std::string_view value);
 
 public:
+    // Walks every version in skiplist order without locking. The memtable
+    // must outlive it.
+    class Iterator
+    {
+    private:
+        const MemTable *table;
+        Node *node;
+
+    public:
+        explicit Iterator(const MemTable *table);
+        bool valid() const;
+        void seek_to_first();
+        // First version of the first key >= target.
+        void seek(std::string_view target);
+        void next();
+        std::string_view key() const;
+        // Tagged with its ValueType and sequence number.
+        std::string_view value() const;
+    };
+
     MemTable();
-    void put(const std::string &key, const std::string &value);
-    bool get(const std::string &key, std::string &value) const;
-    std::vector<std::pair<std::string, std::string>> scan(const std::string &start, const std::string &end, int limit = 1000) const;
+    MemTable(const MemTable &) = delete;
+    MemTable &operator=(const MemTable &) = delete;
+
+    void add(uint64_t sequence, ValueType type, std::string_view key, std::string_view value);
+    // Ops get consecutive sequence numbers starting at sequence.
+    void apply(const WriteBatch &batch, uint64_t sequence);
+    bool get(const std::string &key, std::string &value, uint64_t snapshot = MAX_SEQUENCE_NUMBER) const;
+    std::vector<std::pair<std::string, std::string>> scan(const std::string &start, const std::string &end, int limit = 1000,
+                                                          uint64_t snapshot = MAX_SEQUENCE_NUMBER) const;
     size_t size() const;
+    size_t memory_usage() const;
     bool should_flush() const;
+    // Every version of every key, in skiplist order.
     std::vector<std::pair<std::string, std::string>> get_sorted_data() const;
-    void clear();
 };
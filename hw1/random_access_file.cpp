@@ -0,0 +1,180 @@
+#include "random_access_file.h"
+#include "utils.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+
+RandomAccessFile *RandomAccessFile::open(const std::string &filename, bool use_mmap)
+{
+    if (use_mmap)
+    {
+        MmapFile *file = new MmapFile(filename);
+        if (file->is_open())
+        {
+            return file;
+        }
+        delete file;
+        return nullptr;
+    }
+
+    PreadFile *file = new PreadFile(filename);
+    if (file->is_open())
+    {
+        return file;
+    }
+    delete file;
+    return nullptr;
+}
+
+PreadFile::PreadFile(const std::string &filename) : fd(-1), file_size(0)
+{
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        fd = -1;
+        return;
+    }
+    file_size = st.st_size;
+}
+
+PreadFile::~PreadFile()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+bool PreadFile::is_open() const
+{
+    return fd >= 0;
+}
+
+bool PreadFile::read(uint64_t offset, size_t n, std::string &scratch, std::string_view &result) const
+{
+    if (offset + n > file_size)
+    {
+        return false;
+    }
+
+    scratch.resize(n);
+    size_t done = 0;
+    while (done < n)
+    {
+        ssize_t r = pread(fd, &scratch[done], n - done, offset + done);
+        if (r < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (r <= 0)
+        {
+            return false;
+        }
+        done += r;
+    }
+
+    result = std::string_view(scratch.data(), n);
+    return true;
+}
+
+uint64_t PreadFile::size() const
+{
+    return file_size;
+}
+
+MmapFile::MmapFile(const std::string &filename) : data(nullptr), file_size(0), sequential_readers(0)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            data = static_cast<const char *>(addr);
+            file_size = st.st_size;
+            apply_advice(MADV_RANDOM);
+        }
+        else
+        {
+            LOG_ERROR("mmap failed for %s", filename.c_str());
+        }
+    }
+    ::close(fd);
+}
+
+MmapFile::~MmapFile()
+{
+    if (data)
+    {
+        munmap(const_cast<char *>(data), file_size);
+    }
+}
+
+bool MmapFile::is_open() const
+{
+    return data != nullptr;
+}
+
+bool MmapFile::read(uint64_t offset, size_t n, std::string &, std::string_view &result) const
+{
+    if (offset + n > file_size)
+    {
+        return false;
+    }
+
+    result = std::string_view(data + offset, n);
+    return true;
+}
+
+uint64_t MmapFile::size() const
+{
+    return file_size;
+}
+
+void MmapFile::apply_advice(int advice) const
+{
+    madvise(const_cast<char *>(data), file_size, advice);
+}
+
+// Mappings start out random; only sequential readers change that.
+void MmapFile::advise(AccessPattern pattern) const
+{
+    if (pattern != AccessPattern::Sequential)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(advice_mutex);
+    if (sequential_readers++ == 0)
+    {
+        apply_advice(MADV_SEQUENTIAL);
+    }
+}
+
+void MmapFile::release_advice(AccessPattern pattern) const
+{
+    if (pattern != AccessPattern::Sequential)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(advice_mutex);
+    if (--sequential_readers == 0)
+    {
+        apply_advice(MADV_RANDOM);
+    }
+}
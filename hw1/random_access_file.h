@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <mutex>
+#include <cstdint>
+
+enum class AccessPattern
+{
+    Normal,
+    Random,
+    Sequential
+};
+
+// Read-only view of an immutable file. read() either points result into
+// the file's own memory (mmap) or copies the bytes into scratch (pread).
+class RandomAccessFile
+{
+public:
+    virtual ~RandomAccessFile() = default;
+    virtual bool read(uint64_t offset, size_t n, std::string &scratch, std::string_view &result) const = 0;
+    virtual uint64_t size() const = 0;
+    // Every advise() is paired with a release_advice() for the same pattern
+    // once the reader is done.
+    virtual void advise(AccessPattern) const {}
+    virtual void release_advice(AccessPattern) const {}
+
+    static RandomAccessFile *open(const std::string &filename, bool use_mmap);
+};
+
+// Reads with pread(), which takes its own offset, so concurrent readers
+// share the descriptor without locking.
+class PreadFile : public RandomAccessFile
+{
+private:
+    int fd;
+    uint64_t file_size;
+
+public:
+    PreadFile(const std::string &filename);
+    ~PreadFile();
+    bool is_open() const;
+    bool read(uint64_t offset, size_t n, std::string &scratch, std::string_view &result) const override;
+    uint64_t size() const override;
+};
+
+class MmapFile : public RandomAccessFile
+{
+private:
+    const char *data;
+    uint64_t file_size;
+    // The mapping is shared, so it stays sequential while any reader still
+    // scans it and goes back to random for point lookups afterwards.
+    mutable std::mutex advice_mutex;
+    mutable size_t sequential_readers;
+
+    void apply_advice(int advice) const;
+
+public:
+    MmapFile(const std::string &filename);
+    ~MmapFile();
+    bool is_open() const;
+    bool read(uint64_t offset, size_t n, std::string &scratch, std::string_view &result) const override;
+    uint64_t size() const override;
+    void advise(AccessPattern pattern) const override;
+    void release_advice(AccessPattern pattern) const override;
+};
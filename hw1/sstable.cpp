@@ -5,7 +5,62 @@
 #include <algorithm>
 #include <filesystem>
 
-SSTable::SSTable(const std::string &fname) : filename(fname), bloom_filter(nullptr), num_entries(0)
+// v1: [magic u32][num_entries u32][bloom_offset u32][records][bloom]
+//     [index][index_offset u64][index_count u32][index magic u32]
+// v2: [data blocks][filter block][index block][footer]
+// v3: same layout as v2; the filter block is sized from the entry count and
+//     ends with its parameters (see BloomFilter). v2 filters are legacy.
+// v4: same layout as v3; record values start with their ValueType byte.
+// v5: record values start with the full tag (type and sequence number), and
+//     a key may have several records, newest first, always in one block.
+// v6: data blocks end with the offset of every record in the block, then
+//     their count: [records][offset u32]...[count u32]. Older blocks have
+//     their offsets found by walking the records.
+// v7: the index block ends with the table's largest key as
+//     [key][key_size u32]. Older tables read it from their last block at
+//     open; the smallest key is always the first index entry's.
+// v8: records are prefix-compressed against the previous key:
+//     [shared varint][unshared varint][value_size varint][key suffix][value].
+//     Every SSTABLE_RESTART_INTERVAL-th record is a restart point with
+//     shared = 0, and the block trailer lists the restart points instead of
+//     every record.
+// v9: every block ends with its CompressionType byte, covered by the
+//     checksum; the rest of the block is stored in that codec's format.
+//     Blocks are decompressed before they enter the block cache.
+// Older versions are tagged with sequence number 0 when read; before v4
+// deletions are the LEGACY_TOMBSTONE value.
+// Records before v8 are [key_size u32][value_size u32][key][value], each
+// one a restart point.
+const size_t SSTABLE_BLOCK_SIZE = 4 * 1024;
+const size_t SSTABLE_RESTART_INTERVAL = 16;
+const uint64_t SSTABLE_HEADER_SIZE = sizeof(uint32_t) * 3;
+const uint64_t SSTABLE_INDEX_TRAILER_SIZE = sizeof(uint64_t) + sizeof(uint32_t) * 2;
+const uint64_t SSTABLE_FOOTER_SIZE = sizeof(uint64_t) * 5 + sizeof(uint32_t) * 4;
+const size_t SSTABLE_BLOCK_HANDLE_SIZE = sizeof(uint64_t) * 2 + sizeof(uint32_t);
+
+static BlockHandle decode_block_handle(const char *ptr)
+{
+    return {decode_uint64(ptr), decode_uint64(ptr + sizeof(uint64_t)), decode_uint32(ptr + sizeof(uint64_t) * 2)};
+}
+
+static void put_block_handle(std::string &dst, const BlockHandle &handle)
+{
+    put_uint64(dst, handle.offset);
+    put_uint64(dst, handle.size);
+    put_uint32(dst, handle.crc);
+}
+
+static BlockHandle write_block(std::ofstream &file, uint64_t &offset, std::string &data,
+                               CompressionType type = CompressionType::None)
+{
+    data.push_back(static_cast<char>(type));
+    BlockHandle handle{offset, data.size(), crc32c(data.data(), data.size())};
+    file.write(data.data(), data.size());
+    offset += data.size();
+    return handle;
+}
+
+SSTable::SSTable(const std::string &fname, const SSTableOptions &opts) : filename(fname), options(opts), bloom_filter(nullptr), num_entries(0), format_version(SSTABLE_FORMAT_VERSION)
 {
     bloom_filter = new BloomFilter();
 }
@@ -16,150 +71,907 @@ SSTable::~SSTable()
 }
 
 SSTable *SSTable::create_from_sorted_data(const std::string &filename,
-                                          const std::vector<std::pair<std::string, std::string>> &data)
+                                          const std::vector<std::pair<std::string, std::string>> &data,
+                                          const SSTableOptions &opts)
 {
-    SSTable *sst = new SSTable(filename);
-    sst->num_entries = data.size();
+    std::unique_ptr<SSTableBuilder> builder(SSTableBuilder::create(filename, data.size(), opts));
+    if (!builder)
+    {
+        return nullptr;
+    }
 
-    std::ofstream file(filename, std::ios::binary);
-    if (!file)
+    for (const auto &[key, value] : data)
+    {
+        builder->add(key, value);
+    }
+    return builder->finish();
+}
+
+SSTableBuilder::SSTableBuilder(SSTable *sst) : table(sst), offset(0), block_entries(0), finished(false) {}
+
+SSTableBuilder::~SSTableBuilder()
+{
+    if (!finished)
+    {
+        file.close();
+        std::error_code ec;
+        std::filesystem::remove(table->filename, ec);
+    }
+    delete table;
+}
+
+SSTableBuilder *SSTableBuilder::create(const std::string &filename, size_t expected_entries, const SSTableOptions &opts)
+{
+    SSTable *sst = new SSTable(filename, opts);
+    *sst->bloom_filter = BloomFilter(expected_entries, opts.bloom_bits_per_key, opts.bloom_filter_type);
+
+    SSTableBuilder *builder = new SSTableBuilder(sst);
+    builder->file.open(filename, std::ios::binary);
+    if (!builder->file)
     {
         std::cerr << "Cannot create SSTable file: " << filename << std::endl;
-        delete sst;
+        builder->finished = true;
+        delete builder;
         return nullptr;
     }
+    return builder;
+}
 
-    uint32_t header_size = sizeof(uint32_t) * 3;
-    file.seekp(header_size);
+void SSTableBuilder::add(std::string_view key, std::string_view value)
+{
+    // Versions of one key never straddle a block boundary, so a lookup only
+    // ever reads the block find_block() picks.
+    if (block.size() >= SSTABLE_BLOCK_SIZE && key != last_key)
+    {
+        flush_block();
+    }
+
+    size_t shared = 0;
+    if (block_entries % SSTABLE_RESTART_INTERVAL == 0)
+    {
+        restarts.push_back(block.size());
+    }
+    else
+    {
+        size_t limit = std::min(key.size(), last_key.size());
+        while (shared < limit && key[shared] == last_key[shared])
+        {
+            shared++;
+        }
+    }
 
-    uint64_t current_offset = header_size;
-    for (size_t i = 0; i < data.size(); i++)
+    if (block.empty())
     {
-        const auto &[key, value] = data[i];
+        first_key = key;
+    }
+    last_key = key;
 
-        sst->bloom_filter->add(key);
+    table->bloom_filter->add(key);
+    table->num_entries++;
+    block_entries++;
 
-        uint32_t key_size = key.size();
-        uint32_t value_size = value.size();
+    put_varint32(block, shared);
+    put_varint32(block, key.size() - shared);
+    put_varint32(block, value.size());
+    block.append(key.substr(shared));
+    block.append(value);
+}
 
-        write_uint32(file, key_size);
-        write_uint32(file, value_size);
-        file.write(key.c_str(), key_size);
-        file.write(value.c_str(), value_size);
+void SSTableBuilder::flush_block()
+{
+    for (uint32_t restart : restarts)
+    {
+        put_uint32(block, restart);
+    }
+    put_uint32(block, restarts.size());
 
-        current_offset += sizeof(key_size) + sizeof(value_size) + key_size + value_size;
+    const SSTableOptions &options = table->options;
+    const Codec *codec = get_codec(options.compression);
+    bool use_compressed = false;
+    if (codec)
+    {
+        codec->compress(block, compressed);
+        use_compressed = compressed.size() < block.size() - block.size() / 8;
     }
+    std::string &stored = use_compressed ? compressed : block;
+    if (options.compression_stats)
+    {
+        options.compression_stats->record_write(block.size(), stored.size(), use_compressed);
+    }
+    table->index.push_back({first_key, write_block(file, offset, stored,
+                                                   use_compressed ? codec->type() : CompressionType::None)});
+    block.clear();
+    restarts.clear();
+    block_entries = 0;
+}
 
-    auto bloom_data = sst->bloom_filter->serialize();
-    uint32_t bloom_offset = current_offset;
-    uint32_t bloom_size = bloom_data.size();
-    file.write(reinterpret_cast<const char *>(bloom_data.data()), bloom_size);
+SSTable *SSTableBuilder::finish()
+{
+    if (!block.empty())
+    {
+        flush_block();
+    }
 
-    file.seekp(0);
-    uint32_t magic = SSTABLE_MAGIC;
-    write_uint32(file, magic);
-    write_uint32(file, sst->num_entries);
-    write_uint32(file, bloom_offset);
+    std::string filter_block = table->bloom_filter->serialize();
+    BlockHandle filter_handle = write_block(file, offset, filter_block);
+
+    std::string index_block;
+    for (const auto &entry : table->index)
+    {
+        put_uint32(index_block, entry.first_key.size());
+        index_block.append(entry.first_key);
+        put_block_handle(index_block, entry.handle);
+    }
+    table->smallest_key = table->index.empty() ? std::string() : table->index.front().first_key;
+    table->largest_key = last_key;
+    index_block.append(last_key);
+    put_uint32(index_block, last_key.size());
+    BlockHandle index_handle = write_block(file, offset, index_block);
+
+    std::string footer;
+    put_uint64(footer, table->num_entries);
+    put_block_handle(footer, filter_handle);
+    put_block_handle(footer, index_handle);
+    put_uint32(footer, SSTABLE_FORMAT_VERSION);
+    put_uint32(footer, SSTABLE_FOOTER_MAGIC);
+    file.write(footer.data(), footer.size());
+    offset += footer.size();
 
     file.close();
+    if (!file)
+    {
+        std::cerr << "Cannot write SSTable file: " << table->filename << std::endl;
+        return nullptr;
+    }
+
+    // The table is recorded in the manifest, and the log it came from is
+    // deleted, as soon as this returns, so it and its directory entry must
+    // be on disk first.
+    std::filesystem::path dir = std::filesystem::path(table->filename).parent_path();
+    if (!sync_path(table->filename) || !sync_path(dir.empty() ? "." : dir.string()))
+    {
+        std::cerr << "Cannot sync SSTable file: " << table->filename << std::endl;
+        return nullptr;
+    }
+
+    table->file.reset(RandomAccessFile::open(table->filename, table->options.use_mmap));
+    if (!table->file)
+    {
+        std::cerr << "Cannot open SSTable file: " << table->filename << std::endl;
+        return nullptr;
+    }
+
+    SSTable *sst = table;
+    table = nullptr;
+    finished = true;
     return sst;
 }
 
-bool SSTable::get(const std::string &key, std::string &value) const
+uint64_t SSTableBuilder::get_file_size() const
 {
-    if (!bloom_filter->might_contain(key))
+    return offset + block.size();
+}
+
+size_t SSTableBuilder::get_num_entries() const
+{
+    return table->num_entries;
+}
+
+SSTable *SSTable::open(const std::string &filename, const SSTableOptions &opts)
+{
+    SSTable *sst = new SSTable(filename, opts);
+    sst->file.reset(RandomAccessFile::open(filename, opts.use_mmap));
+    if (!sst->file)
+    {
+        std::cerr << "Cannot open SSTable file: " << filename << std::endl;
+        delete sst;
+        return nullptr;
+    }
+
+    uint64_t file_size = sst->file->size();
+    std::string scratch;
+    std::string_view magic;
+
+    bool loaded = false;
+    if (file_size >= SSTABLE_FOOTER_SIZE &&
+        sst->file->read(file_size - sizeof(uint32_t), sizeof(uint32_t), scratch, magic) &&
+        decode_uint32(magic.data()) == SSTABLE_FOOTER_MAGIC)
+    {
+        loaded = sst->load_v2();
+    }
+    if (!loaded && file_size >= SSTABLE_HEADER_SIZE)
+    {
+        sst->index.clear();
+        loaded = sst->load_v1();
+    }
+
+    if (!loaded || !sst->load_key_range())
+    {
+        std::cerr << "Invalid SSTable file: " << filename << std::endl;
+        delete sst;
+        return nullptr;
+    }
+
+    return sst;
+}
+
+// Before v7 the largest key is only in the last block.
+bool SSTable::load_key_range()
+{
+    if (index.empty())
+    {
+        return true;
+    }
+    smallest_key = index.front().first_key;
+    if (format_version >= 7)
+    {
+        return true;
+    }
+
+    BlockContents contents;
+    BlockIterator entries;
+    if (!read_block(index.back().handle, contents, false) || !entries.init(contents.data, format_version))
+    {
+        return false;
+    }
+    entries.seek_to_last();
+    if (!entries.valid())
     {
         return false;
     }
+    largest_key = entries.key();
+    return true;
+}
 
-    std::ifstream file(filename, std::ios::binary);
-    if (!file)
+bool SSTable::load_v1()
+{
+    uint64_t file_size = file->size();
+    std::string scratch;
+    std::string_view header;
+    if (!file->read(0, SSTABLE_HEADER_SIZE, scratch, header))
+    {
+        return false;
+    }
+
+    uint32_t magic = decode_uint32(header.data());
+    uint32_t entries = decode_uint32(header.data() + sizeof(uint32_t));
+    uint32_t bloom_offset = decode_uint32(header.data() + sizeof(uint32_t) * 2);
+    if (magic != SSTABLE_MAGIC || bloom_offset < SSTABLE_HEADER_SIZE || bloom_offset > file_size)
+    {
+        return false;
+    }
+
+    format_version = 1;
+    num_entries = entries;
+
+    // Tables written before the sparse index existed end right after the
+    // bloom filter; for those the index is rebuilt with one pass at open.
+    uint64_t bloom_end = file_size;
+    std::string_view trailer;
+    if (file_size >= bloom_offset + SSTABLE_INDEX_TRAILER_SIZE &&
+        file->read(file_size - SSTABLE_INDEX_TRAILER_SIZE, SSTABLE_INDEX_TRAILER_SIZE, scratch, trailer))
+    {
+        uint64_t index_offset = decode_uint64(trailer.data());
+        uint32_t index_count = decode_uint32(trailer.data() + sizeof(uint64_t));
+        uint32_t index_magic = decode_uint32(trailer.data() + sizeof(uint64_t) + sizeof(uint32_t));
+
+        std::string_view index_data;
+        if (index_magic == SSTABLE_INDEX_MAGIC && index_offset >= bloom_offset &&
+            file->read(index_offset, file_size - SSTABLE_INDEX_TRAILER_SIZE - index_offset, scratch, index_data))
+        {
+            bloom_end = index_offset;
+            index.reserve(index_count);
+            size_t pos = 0;
+            for (uint32_t i = 0; i < index_count; i++)
+            {
+                if (pos + sizeof(uint32_t) > index_data.size())
+                {
+                    return false;
+                }
+                uint32_t key_size = decode_uint32(&index_data[pos]);
+                pos += sizeof(uint32_t);
+                if (pos + key_size + sizeof(uint64_t) > index_data.size())
+                {
+                    return false;
+                }
+                std::string first_key(index_data.substr(pos, key_size));
+                uint64_t offset = decode_uint64(&index_data[pos + key_size]);
+                pos += key_size + sizeof(uint64_t);
+                index.push_back({std::move(first_key), {offset, 0, 0}});
+            }
+            for (size_t i = 0; i < index.size(); i++)
+            {
+                uint64_t end = i + 1 < index.size() ? index[i + 1].handle.offset : bloom_offset;
+                index[i].handle.size = end - index[i].handle.offset;
+            }
+        }
+    }
+
+    std::string_view bloom_view;
+    if (!file->read(bloom_offset, bloom_end - bloom_offset, scratch, bloom_view))
+    {
+        return false;
+    }
+    bloom_filter->deserialize_legacy(bloom_view);
+
+    if (index.empty() && num_entries > 0)
+    {
+        return build_v1_index(bloom_offset);
+    }
+
+    return true;
+}
+
+bool SSTable::build_v1_index(uint64_t data_end)
+{
+    std::string scratch;
+    std::string_view record;
+
+    uint64_t current_offset = SSTABLE_HEADER_SIZE;
+    uint64_t block_offset = current_offset;
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        if (!file->read(current_offset, sizeof(uint32_t) * 2, scratch, record))
+        {
+            return false;
+        }
+        uint32_t key_size = decode_uint32(record.data());
+        uint32_t value_size = decode_uint32(record.data() + sizeof(uint32_t));
+
+        if (i == 0 || current_offset - block_offset >= SSTABLE_BLOCK_SIZE)
+        {
+            std::string_view key;
+            if (!file->read(current_offset + sizeof(uint32_t) * 2, key_size, scratch, key))
+            {
+                return false;
+            }
+
+            if (!index.empty())
+            {
+                index.back().handle.size = current_offset - block_offset;
+            }
+            block_offset = current_offset;
+            index.push_back({std::string(key), {block_offset, 0, 0}});
+        }
+
+        current_offset += sizeof(key_size) + sizeof(value_size) + key_size + value_size;
+    }
+
+    if (!index.empty())
+    {
+        index.back().handle.size = data_end - block_offset;
+    }
+    return true;
+}
+
+bool SSTable::load_v2()
+{
+    uint64_t file_size = file->size();
+    std::string scratch;
+    std::string_view footer;
+    if (!file->read(file_size - SSTABLE_FOOTER_SIZE, SSTABLE_FOOTER_SIZE, scratch, footer))
     {
         return false;
     }
 
-    uint32_t magic, num_entries, bloom_offset;
-    magic = read_uint32(file);
-    num_entries = read_uint32(file);
-    bloom_offset = read_uint32(file);
+    const char *ptr = footer.data();
+    num_entries = decode_uint64(ptr);
+    ptr += sizeof(uint64_t);
+    BlockHandle filter_handle = decode_block_handle(ptr);
+    ptr += SSTABLE_BLOCK_HANDLE_SIZE;
+    BlockHandle index_handle = decode_block_handle(ptr);
+    ptr += SSTABLE_BLOCK_HANDLE_SIZE;
+    format_version = decode_uint32(ptr);
 
-    int left = 0, right = num_entries - 1;
+    if (format_version < 2 || format_version > SSTABLE_FORMAT_VERSION)
+    {
+        return false;
+    }
 
-    while (left <= right)
+    BlockContents filter_block;
+    if (!read_block(filter_handle, filter_block, true, options.pin_meta_blocks))
+    {
+        return false;
+    }
+    bool filter_ok = format_version >= 3 ? bloom_filter->deserialize(filter_block.data)
+                                         : bloom_filter->deserialize_legacy(filter_block.data);
+    if (!filter_ok)
     {
-        int mid = left + (right - left) / 2;
+        return false;
+    }
 
-        uint64_t mid_offset = sizeof(uint32_t) * 3;
-        file.seekg(mid_offset);
+    BlockContents index_block;
+    if (!read_block(index_handle, index_block, true, options.pin_meta_blocks))
+    {
+        return false;
+    }
+    std::string_view index_data = index_block.data;
+    if (format_version >= 7)
+    {
+        if (index_data.size() < sizeof(uint32_t))
+        {
+            return false;
+        }
+        uint32_t key_size = decode_uint32(index_data.data() + index_data.size() - sizeof(uint32_t));
+        if (key_size > index_data.size() - sizeof(uint32_t))
+        {
+            return false;
+        }
+        index_data.remove_suffix(sizeof(uint32_t));
+        largest_key = index_data.substr(index_data.size() - key_size);
+        index_data.remove_suffix(key_size);
+    }
 
-        for (int i = 0; i < mid; i++)
+    size_t pos = 0;
+    while (pos + sizeof(uint32_t) <= index_data.size())
+    {
+        uint32_t key_size = decode_uint32(&index_data[pos]);
+        pos += sizeof(uint32_t);
+        if (pos + key_size + SSTABLE_BLOCK_HANDLE_SIZE > index_data.size())
         {
-            uint32_t key_size = read_uint32(file);
-            uint32_t value_size = read_uint32(file);
-            file.seekg(key_size + value_size, std::ios::cur);
+            return false;
         }
 
-        uint32_t key_size = read_uint32(file);
-        uint32_t value_size = read_uint32(file);
-        std::string current_key(key_size, '\0');
-        file.read(&current_key[0], key_size);
+        std::string first_key(index_data.substr(pos, key_size));
+        pos += key_size;
+        index.push_back({std::move(first_key), decode_block_handle(&index_data[pos])});
+        pos += SSTABLE_BLOCK_HANDLE_SIZE;
+    }
+
+    return pos == index_data.size();
+}
 
-        if (current_key == key)
+bool SSTable::read_block(const BlockHandle &handle, BlockContents &contents, bool fill_cache, bool pin) const
+{
+    BlockCache *cache = options.block_cache;
+    if (cache)
+    {
+        contents.cached = cache->lookup(options.file_id, handle.offset);
+        if (contents.cached)
         {
-            value.resize(value_size);
-            file.read(&value[0], value_size);
+            contents.data = *contents.cached;
             return true;
         }
-        else if (current_key < key)
+    }
+
+    if (!file->read(handle.offset, handle.size, contents.scratch, contents.data))
+    {
+        return false;
+    }
+
+    if (format_version >= 2 && crc32c(contents.data.data(), contents.data.size()) != handle.crc)
+    {
+        std::cerr << "Checksum mismatch in SSTable " << filename << " at offset " << handle.offset << std::endl;
+        return false;
+    }
+
+    if (format_version >= 9)
+    {
+        if (contents.data.empty())
+        {
+            return false;
+        }
+        CompressionType type = static_cast<CompressionType>(contents.data.back());
+        contents.data.remove_suffix(1);
+        if (type != CompressionType::None)
+        {
+            const Codec *codec = get_codec(type);
+            std::string decompressed;
+            if (!codec || !codec->decompress(contents.data, decompressed))
+            {
+                std::cerr << "Cannot decompress block in SSTable " << filename << " at offset " << handle.offset << std::endl;
+                return false;
+            }
+            if (options.compression_stats)
+            {
+                options.compression_stats->record_read(decompressed.size());
+            }
+            contents.scratch = std::move(decompressed);
+            contents.data = contents.scratch;
+        }
+    }
+
+    if (cache && fill_cache)
+    {
+        contents.cached = std::make_shared<const std::string>(contents.data);
+        contents.data = *contents.cached;
+        cache->insert(options.file_id, handle.offset, contents.cached, pin);
+    }
+
+    return true;
+}
+
+void SSTable::decode_value(std::string_view raw, std::string &value) const
+{
+    if (format_version >= 5)
+    {
+        value.assign(raw);
+    }
+    else if (format_version == 4)
+    {
+        value = raw.empty() ? tag_value(ValueType::Deletion, 0) : tag_value(static_cast<ValueType>(raw[0]), 0, raw.substr(1));
+    }
+    else if (raw == LEGACY_TOMBSTONE)
+    {
+        value = tag_value(ValueType::Deletion, 0);
+    }
+    else
+    {
+        value = tag_value(ValueType::Value, 0, raw);
+    }
+}
+
+uint64_t SSTable::record_sequence(std::string_view raw) const
+{
+    return format_version >= 5 ? value_sequence(raw) : 0;
+}
+
+BlockIterator::BlockIterator() : prefix_compressed(false), current(0), next_offset(0) {}
+
+bool BlockIterator::init(std::string_view block, uint32_t format_version)
+{
+    // A block that fails to decode leaves the cursor empty.
+    restarts.clear();
+    records = std::string_view();
+    invalidate();
+    prefix_compressed = format_version >= 8;
+    std::string_view data = block;
+
+    if (format_version < 6)
+    {
+        // No trailer: every record is a restart point, found by walking them.
+        size_t pos = 0;
+        while (pos < block.size())
+        {
+            if (pos + sizeof(uint32_t) * 2 > block.size())
+            {
+                restarts.clear();
+                return false;
+            }
+            restarts.push_back(pos);
+            pos += sizeof(uint32_t) * 2 + decode_uint32(&block[pos]) + decode_uint32(&block[pos + sizeof(uint32_t)]);
+        }
+        if (pos != block.size())
+        {
+            restarts.clear();
+            return false;
+        }
+    }
+    else
+    {
+        if (block.size() < sizeof(uint32_t))
+        {
+            return false;
+        }
+        uint32_t count = decode_uint32(block.data() + block.size() - sizeof(uint32_t));
+        if (count > (block.size() - sizeof(uint32_t)) / sizeof(uint32_t))
+        {
+            return false;
+        }
+        size_t trailer = block.size() - sizeof(uint32_t) * (count + 1);
+        data = block.substr(0, trailer);
+        restarts.resize(count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            restarts[i] = decode_uint32(block.data() + trailer + sizeof(uint32_t) * i);
+            if (restarts[i] >= trailer || (i > 0 && restarts[i] <= restarts[i - 1]))
+            {
+                restarts.clear();
+                return false;
+            }
+        }
+    }
+
+    records = data;
+    invalidate();
+    return true;
+}
+
+void BlockIterator::invalidate()
+{
+    current = records.size();
+    next_offset = records.size();
+    current_key.clear();
+    current_value = std::string_view();
+}
+
+// Decodes the record at next_offset against current_key.
+bool BlockIterator::parse_next()
+{
+    current = next_offset;
+    const char *ptr = records.data() + current;
+    const char *limit = records.data() + records.size();
+    uint32_t shared = 0;
+    uint32_t unshared = 0;
+    uint32_t value_size = 0;
+    if (current >= records.size())
+    {
+        invalidate();
+        return false;
+    }
+
+    if (prefix_compressed)
+    {
+        ptr = decode_varint32(ptr, limit, shared);
+        ptr = ptr ? decode_varint32(ptr, limit, unshared) : nullptr;
+        ptr = ptr ? decode_varint32(ptr, limit, value_size) : nullptr;
+    }
+    else if (limit - ptr >= static_cast<ptrdiff_t>(sizeof(uint32_t) * 2))
+    {
+        unshared = decode_uint32(ptr);
+        value_size = decode_uint32(ptr + sizeof(uint32_t));
+        ptr += sizeof(uint32_t) * 2;
+    }
+    else
+    {
+        ptr = nullptr;
+    }
+
+    if (!ptr || shared > current_key.size() || static_cast<uint64_t>(limit - ptr) < static_cast<uint64_t>(unshared) + value_size)
+    {
+        invalidate();
+        return false;
+    }
+
+    current_key.resize(shared);
+    current_key.append(ptr, unshared);
+    current_value = std::string_view(ptr + unshared, value_size);
+    next_offset = ptr + unshared + value_size - records.data();
+    return true;
+}
+
+// Restart points store their whole key, so it can be read in place.
+std::string_view BlockIterator::restart_key(size_t index) const
+{
+    const char *ptr = records.data() + restarts[index];
+    const char *limit = records.data() + records.size();
+    uint32_t shared = 0;
+    uint32_t key_size = 0;
+    uint32_t value_size = 0;
+    if (prefix_compressed)
+    {
+        ptr = decode_varint32(ptr, limit, shared);
+        ptr = ptr ? decode_varint32(ptr, limit, key_size) : nullptr;
+        ptr = ptr ? decode_varint32(ptr, limit, value_size) : nullptr;
+    }
+    else if (limit - ptr >= static_cast<ptrdiff_t>(sizeof(uint32_t) * 2))
+    {
+        key_size = decode_uint32(ptr);
+        ptr += sizeof(uint32_t) * 2;
+    }
+    else
+    {
+        ptr = nullptr;
+    }
+
+    if (!ptr || shared != 0 || static_cast<size_t>(limit - ptr) < key_size)
+    {
+        return std::string_view();
+    }
+    return std::string_view(ptr, key_size);
+}
+
+void BlockIterator::seek_to_restart(size_t index)
+{
+    current_key.clear();
+    next_offset = restarts[index];
+}
+
+bool BlockIterator::valid() const
+{
+    return current < records.size();
+}
+
+void BlockIterator::seek_to_first()
+{
+    if (restarts.empty())
+    {
+        invalidate();
+        return;
+    }
+    seek_to_restart(0);
+    parse_next();
+}
+
+void BlockIterator::seek_to_last()
+{
+    if (restarts.empty())
+    {
+        invalidate();
+        return;
+    }
+    seek_to_restart(restarts.size() - 1);
+    while (parse_next() && next_offset < records.size())
+    {
+    }
+}
+
+void BlockIterator::seek(std::string_view target)
+{
+    // Every record before the first restart point with a key >= target
+    // sorts below target, so decoding starts one restart point earlier.
+    size_t left = 0;
+    size_t right = restarts.size();
+    while (left < right)
+    {
+        size_t mid = left + (right - left) / 2;
+        if (restart_key(mid) < target)
         {
             left = mid + 1;
         }
         else
         {
-            right = mid - 1;
+            right = mid;
         }
     }
 
-    return false;
+    if (restarts.empty())
+    {
+        invalidate();
+        return;
+    }
+    seek_to_restart(left == 0 ? 0 : left - 1);
+    while (parse_next() && std::string_view(current_key) < target)
+    {
+    }
 }
 
-std::vector<std::pair<std::string, std::string>> SSTable::scan(const std::string &start, const std::string &end, int limit) const
+void BlockIterator::next()
 {
-    std::vector<std::pair<std::string, std::string>> result;
+    parse_next();
+}
 
-    std::ifstream file(filename, std::ios::binary);
-    if (!file)
-        return result;
+void BlockIterator::prev()
+{
+    size_t original = current;
+    auto it = std::lower_bound(restarts.begin(), restarts.end(), original);
+    if (it == restarts.begin())
+    {
+        invalidate();
+        return;
+    }
+    seek_to_restart(it - restarts.begin() - 1);
+    while (parse_next() && next_offset < original)
+    {
+    }
+}
 
-    uint32_t magic, num_entries, bloom_offset;
-    magic = read_uint32(file);
-    num_entries = read_uint32(file);
-    bloom_offset = read_uint32(file);
+std::string_view BlockIterator::key() const
+{
+    return current_key;
+}
 
-    uint64_t start_offset = sizeof(uint32_t) * 3;
+std::string_view BlockIterator::value() const
+{
+    return current_value;
+}
 
-    file.seekg(start_offset);
-    while (static_cast<uint64_t>(file.tellg()) < bloom_offset && result.size() < limit)
+size_t SSTable::find_block(std::string_view key) const
+{
+    auto it = std::upper_bound(index.begin(), index.end(), key,
+                               [](std::string_view k, const SSTableIndexEntry &entry)
+                               { return k < entry.first_key; });
+    if (it == index.begin())
     {
-        uint32_t key_size, value_size;
-        key_size = read_uint32(file);
-        value_size = read_uint32(file);
+        return index.size();
+    }
+    return static_cast<size_t>(it - index.begin()) - 1;
+}
 
-        std::string key(key_size, '\0');
-        file.read(&key[0], key_size);
+bool SSTable::get(const std::string &key, std::string &value, uint64_t snapshot) const
+{
+    if (!bloom_filter->might_contain(key))
+    {
+        return false;
+    }
 
-        if (key >= start)
+    size_t block = find_block(key);
+    if (block == index.size())
+    {
+        return false;
+    }
+
+    BlockContents contents;
+    BlockIterator entries;
+    if (!read_block(index[block].handle, contents) || !entries.init(contents.data, format_version))
+    {
+        return false;
+    }
+
+    for (entries.seek(key); entries.valid() && entries.key() == key; entries.next())
+    {
+        if (record_sequence(entries.value()) <= snapshot)
         {
-            if (key > end)
-                break;
+            decode_value(entries.value(), value);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void SSTable::multi_get(const std::vector<std::string_view> &keys, std::vector<bool> &found, std::vector<std::string> &values,
+                        uint64_t snapshot) const
+{
+    found.assign(keys.size(), false);
+    values.resize(keys.size());
+
+    std::vector<bool> candidates;
+    bloom_filter->might_contain_batch(keys, candidates);
+    BlockIterator entries;
 
-            std::string value(value_size, '\0');
-            file.read(&value[0], value_size);
-            result.emplace_back(key, value);
+    size_t i = 0;
+    while (i < keys.size())
+    {
+        size_t block = candidates[i] ? find_block(keys[i]) : index.size();
+        if (block == index.size())
+        {
+            i++;
+            continue;
         }
+
+        // Keys are sorted, so all of them up to the next block's first key
+        // are served by this one read.
+        size_t group_end = i + 1;
+        while (group_end < keys.size() && (block + 1 == index.size() || keys[group_end] < index[block + 1].first_key))
+        {
+            group_end++;
+        }
+
+        BlockContents contents;
+        if (read_block(index[block].handle, contents) && entries.init(contents.data, format_version))
+        {
+            for (size_t k = i; k < group_end; k++)
+            {
+                if (!candidates[k])
+                {
+                    continue;
+                }
+                for (entries.seek(keys[k]); entries.valid() && entries.key() == keys[k]; entries.next())
+                {
+                    if (record_sequence(entries.value()) <= snapshot)
+                    {
+                        found[k] = true;
+                        decode_value(entries.value(), values[k]);
+                        break;
+                    }
+                }
+            }
+        }
+        i = group_end;
+    }
+}
+
+std::vector<std::pair<std::string, std::string>> SSTable::scan(const std::string &start, const std::string &end, int limit,
+                                                               uint64_t snapshot) const
+{
+    std::vector<std::pair<std::string, std::string>> result;
+
+    size_t block = find_block(start);
+    if (block == index.size())
+        block = 0;
+
+    BlockContents contents;
+    BlockIterator entries;
+    for (bool first = true; block < index.size() && result.size() < static_cast<size_t>(limit); block++, first = false)
+    {
+        if (!read_block(index[block].handle, contents) || !entries.init(contents.data, format_version))
+            break;
+
+        if (first)
+            entries.seek(start);
         else
+            entries.seek_to_first();
+        for (; entries.valid() && result.size() < static_cast<size_t>(limit); entries.next())
         {
-            file.seekg(value_size, std::ios::cur);
+            std::string_view key = entries.key();
+            if (key > end)
+                return result;
+            if (record_sequence(entries.value()) <= snapshot && (result.empty() || result.back().first != key))
+            {
+                result.emplace_back(key, std::string());
+                decode_value(entries.value(), result.back().second);
+            }
         }
     }
 
@@ -171,35 +983,165 @@ const std::string &SSTable::get_filename() const
     return filename;
 }
 
-SSTableIterator::SSTableIterator(const std::string &filename, size_t order) : current_entry(0), file_order(order)
+size_t SSTable::get_num_entries() const
+{
+    return num_entries;
+}
+
+size_t SSTable::get_num_blocks() const
+{
+    return index.size();
+}
+
+uint32_t SSTable::get_format_version() const
+{
+    return format_version;
+}
+
+const std::string &SSTable::get_smallest_key() const
+{
+    return smallest_key;
+}
+
+const std::string &SSTable::get_largest_key() const
+{
+    return largest_key;
+}
+
+SSTableIterator::SSTableIterator(const SSTable *sst, size_t order, AccessPattern pattern, ScanDirection direction)
+    : table(sst), current_block(sst->index.size()), file_order(order), fill_cache(pattern != AccessPattern::Sequential),
+      reverse(direction == ScanDirection::Reverse), access_pattern(pattern)
+{
+    if (pattern != AccessPattern::Normal)
+    {
+        table->file->advise(pattern);
+    }
+    if (reverse)
+    {
+        seek_to_last();
+    }
+    else
+    {
+        seek_to_first();
+    }
+}
+
+SSTableIterator::SSTableIterator(const SSTable *sst, size_t order, const std::string &target, AccessPattern pattern,
+                                 ScanDirection direction)
+    : table(sst), current_block(sst->index.size()), file_order(order), fill_cache(pattern != AccessPattern::Sequential),
+      reverse(direction == ScanDirection::Reverse), access_pattern(pattern)
+{
+    if (pattern != AccessPattern::Normal)
+    {
+        table->file->advise(pattern);
+    }
+    seek(target);
+}
+
+// Leaves the cursor unpositioned; on failure the iterator ends.
+bool SSTableIterator::load_block(size_t index)
+{
+    block.data = std::string_view();
+    block.cached.reset();
+    current_block = index;
+
+    if (index >= table->index.size() ||
+        !table->read_block(table->index[index].handle, block, fill_cache) ||
+        !entries.init(block.data, table->format_version))
+    {
+        entries = BlockIterator();
+        current_block = table->index.size();
+        return false;
+    }
+    return true;
+}
+
+// Moves past exhausted blocks in the iteration direction.
+void SSTableIterator::skip_empty_blocks()
+{
+    while (!entries.valid() && current_block < table->index.size())
+    {
+        if (!reverse)
+        {
+            if (load_block(current_block + 1))
+            {
+                entries.seek_to_first();
+            }
+        }
+        else if (current_block == 0)
+        {
+            current_block = table->index.size();
+        }
+        else if (load_block(current_block - 1))
+        {
+            entries.seek_to_last();
+        }
+    }
+}
+
+void SSTableIterator::seek_to_first()
 {
-    file.open(filename, std::ios::binary);
-    if (file)
+    if (load_block(0))
     {
-        uint32_t magic, bloom_offset;
-        magic = read_uint32(file);
-        num_entries = read_uint32(file);
-        bloom_offset = read_uint32(file);
+        entries.seek_to_first();
+    }
+    skip_empty_blocks();
+}
 
-        if (magic == SSTABLE_MAGIC)
+void SSTableIterator::seek_to_last()
+{
+    if (!table->index.empty() && load_block(table->index.size() - 1))
+    {
+        entries.seek_to_last();
+    }
+    skip_empty_blocks();
+}
+
+// find_block() picks the only block that can hold target, and the block's
+// restart points are binary searched.
+void SSTableIterator::seek(const std::string &target)
+{
+    size_t index = table->find_block(target);
+    if (index == table->index.size())
+    {
+        // target sorts before every key.
+        if (reverse)
         {
-            data_start = sizeof(uint32_t) * 3;
-            file.seekg(data_start);
+            load_block(table->index.size());
         }
         else
         {
-            num_entries = 0;
+            seek_to_first();
         }
+        return;
     }
-    else
+
+    if (load_block(index))
     {
-        num_entries = 0;
+        entries.seek(target);
+        if (reverse)
+        {
+            // Back to the last record <= target, past its older versions.
+            while (entries.valid() && entries.key() <= target)
+            {
+                entries.next();
+            }
+            if (entries.valid())
+            {
+                entries.prev();
+            }
+            else
+            {
+                entries.seek_to_last();
+            }
+        }
     }
+    skip_empty_blocks();
 }
 
 bool SSTableIterator::has_next() const
 {
-    return current_entry < num_entries;
+    return entries.valid();
 }
 
 std::pair<std::string, std::string> SSTableIterator::next()
@@ -209,25 +1151,27 @@ std::pair<std::string, std::string> SSTableIterator::next()
         return {"", ""};
     }
 
-    uint32_t key_size = read_uint32(file);
-    uint32_t value_size = read_uint32(file);
-
-    std::string key(key_size, '\0');
-    file.read(&key[0], key_size);
-
-    std::string value(value_size, '\0');
-    file.read(&value[0], value_size);
+    std::pair<std::string, std::string> entry(entries.key(), std::string());
+    table->decode_value(entries.value(), entry.second);
+    if (reverse)
+    {
+        entries.prev();
+    }
+    else
+    {
+        entries.next();
+    }
+    skip_empty_blocks();
 
-    current_entry++;
-    return {key, value};
+    return entry;
 }
 
 size_t SSTableIterator::get_order() const { return file_order; }
 
 SSTableIterator::~SSTableIterator()
 {
-    if (file.is_open())
+    if (access_pattern != AccessPattern::Normal)
     {
-        file.close();
+        table->file->release_advice(access_pattern);
     }
 }
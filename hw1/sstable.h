@@ -5,41 +5,207 @@
 #include <cstdint>
 #include <fstream>
 #include <memory>
+#include <string_view>
 #include "bloom_filter.h"
+#include "random_access_file.h"
+#include "block_cache.h"
+#include "compression.h"
 #include "utils.h"
 
+struct BlockHandle
+{
+    uint64_t offset;
+    uint64_t size;
+    uint32_t crc;
+};
+
+struct BlockContents
+{
+    std::string scratch;
+    std::shared_ptr<const std::string> cached;
+    std::string_view data;
+};
+
+struct SSTableOptions
+{
+    bool use_mmap = false;
+    BlockCache *block_cache = nullptr;
+    uint64_t file_id = 0;
+    bool pin_meta_blocks = false;
+    double bloom_bits_per_key = BLOOM_DEFAULT_BITS_PER_KEY;
+    BloomFilterType bloom_filter_type = BloomFilterType::Blocked;
+    // Codec for the data blocks written; any codec can be read.
+    CompressionType compression = CompressionType::None;
+    CompressionCounters *compression_stats = nullptr;
+};
+
+struct SSTableIndexEntry
+{
+    std::string first_key;
+    BlockHandle handle;
+};
+
+class SSTable;
+
+enum class ScanDirection
+{
+    Forward,
+    Reverse
+};
+
+// Writes an SSTable one record at a time, holding a single data block in
+// memory. Keys must be added in sorted order, with tagged values; versions
+// of one key newest first. The filter is sized up front
+// from expected_entries. Data blocks are compressed with opts.compression
+// unless that saves less than an eighth of the block. A builder destroyed
+// before finish() removes its partial file.
+class SSTableBuilder
+{
+private:
+    SSTable *table;
+    std::ofstream file;
+    uint64_t offset;
+    std::string block;
+    std::string compressed;
+    std::vector<uint32_t> restarts;
+    size_t block_entries;
+    std::string first_key;
+    std::string last_key;
+    bool finished;
+
+    SSTableBuilder(SSTable *sst);
+    void flush_block();
+
+public:
+    ~SSTableBuilder();
+    static SSTableBuilder *create(const std::string &filename, size_t expected_entries,
+                                  const SSTableOptions &opts = SSTableOptions());
+
+    void add(std::string_view key, std::string_view value);
+    SSTable *finish();
+    uint64_t get_file_size() const;
+    size_t get_num_entries() const;
+};
+
+// Cursor over the records of one data block, for every format version.
+// Seeks binary search the block's restart points, records stored with their
+// full key, then decode forward from the closest one; prev() decodes
+// forward from the restart point before the current record. Views returned
+// by key() and value() last until the cursor moves.
+class BlockIterator
+{
+private:
+    std::string_view records;
+    std::vector<uint32_t> restarts;
+    bool prefix_compressed;
+    size_t current;
+    size_t next_offset;
+    std::string current_key;
+    std::string_view current_value;
+
+    bool parse_next();
+    std::string_view restart_key(size_t index) const;
+    void seek_to_restart(size_t index);
+    void invalidate();
+
+public:
+    BlockIterator();
+    // block must outlive the cursor.
+    bool init(std::string_view block, uint32_t format_version);
+    bool valid() const;
+    void seek_to_first();
+    void seek_to_last();
+    // First record with a key >= target.
+    void seek(std::string_view target);
+    void next();
+    void prev();
+    std::string_view key() const;
+    std::string_view value() const;
+};
+
+// Reverse iterators return the records in exactly the opposite order:
+// keys descending, and the versions of a key oldest first. Seeks position
+// the iterator so next() returns the first record with a key >= target,
+// or in reverse the last one with a key <= target.
 class SSTableIterator
 {
 private:
-    std::ifstream file;
-    uint32_t num_entries;
-    uint32_t current_entry;
-    uint64_t data_start;
+    const SSTable *table;
+    size_t current_block;
+    BlockContents block;
+    BlockIterator entries;
     size_t file_order;
+    bool fill_cache;
+    bool reverse;
+    AccessPattern access_pattern;
+
+    bool load_block(size_t index);
+    void skip_empty_blocks();
 
 public:
-    SSTableIterator(const std::string &filename, size_t order);
+    SSTableIterator(const SSTable *sst, size_t order, AccessPattern pattern = AccessPattern::Normal,
+                    ScanDirection direction = ScanDirection::Forward);
+    SSTableIterator(const SSTable *sst, size_t order, const std::string &target, AccessPattern pattern = AccessPattern::Normal,
+                    ScanDirection direction = ScanDirection::Forward);
+    SSTableIterator(const SSTableIterator &) = delete;
+    SSTableIterator &operator=(const SSTableIterator &) = delete;
     ~SSTableIterator();
+    void seek_to_first();
+    void seek_to_last();
+    void seek(const std::string &target);
     bool has_next() const;
     std::pair<std::string, std::string> next();
     size_t get_order() const;
 };
 
+// Values going in and coming out are tagged with their ValueType and
+// sequence number; tables written before format 5 are tagged as they are
+// read. Lookups return the newest version at or below the snapshot.
 class SSTable
 {
 private:
     std::string filename;
+    SSTableOptions options;
+    std::unique_ptr<RandomAccessFile> file;
     BloomFilter *bloom_filter;
     size_t num_entries;
+    uint32_t format_version;
+    std::vector<SSTableIndexEntry> index;
+    std::string smallest_key;
+    std::string largest_key;
+
+    bool load_v1();
+    bool load_key_range();
+    bool load_v2();
+    bool build_v1_index(uint64_t data_end);
+    size_t find_block(std::string_view key) const;
+    void decode_value(std::string_view raw, std::string &value) const;
+    uint64_t record_sequence(std::string_view raw) const;
+    bool read_block(const BlockHandle &handle, BlockContents &contents, bool fill_cache = true, bool pin = false) const;
+
+    friend class SSTableIterator;
+    friend class SSTableBuilder;
 
 public:
-    SSTable(const std::string &fname);
+    SSTable(const std::string &fname, const SSTableOptions &opts = SSTableOptions());
     ~SSTable();
 
     static SSTable *create_from_sorted_data(const std::string &filename,
-                                            const std::vector<std::pair<std::string, std::string>> &data);
+                                            const std::vector<std::pair<std::string, std::string>> &data,
+                                            const SSTableOptions &opts = SSTableOptions());
+    static SSTable *open(const std::string &filename, const SSTableOptions &opts = SSTableOptions());
 
-    bool get(const std::string &key, std::string &value) const;
-    std::vector<std::pair<std::string, std::string>> scan(const std::string &start, const std::string &end, int limit = 1000) const;
+    bool get(const std::string &key, std::string &value, uint64_t snapshot = MAX_SEQUENCE_NUMBER) const;
+    // keys must be sorted. found[i] is set when keys[i] is in this table
+    // (values[i] may then be a deletion).
+    void multi_get(const std::vector<std::string_view> &keys, std::vector<bool> &found, std::vector<std::string> &values,
+                   uint64_t snapshot = MAX_SEQUENCE_NUMBER) const;
+    std::vector<std::pair<std::string, std::string>> scan(const std::string &start, const std::string &end, int limit = 1000,
+                                                          uint64_t snapshot = MAX_SEQUENCE_NUMBER) const;
     const std::string &get_filename() const;
-};
\ No newline at end of file
+    size_t get_num_entries() const;
+    size_t get_num_blocks() const;
+    uint32_t get_format_version() const;
+    const std::string &get_smallest_key() const;
+    const std::string &get_largest_key() const;
+};
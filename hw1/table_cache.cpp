@@ -0,0 +1,100 @@
+#include "table_cache.h"
+#include "utils.h"
+
+TableCache::TableCache(size_t max_open_files, const SSTableOptions &options)
+    : capacity(max_open_files > 0 ? max_open_files : 1), table_options(options), hits(0), misses(0) {}
+
+SSTableOptions TableCache::options_for(uint64_t number) const
+{
+    SSTableOptions options = table_options;
+    options.file_id = number;
+    return options;
+}
+
+std::shared_ptr<SSTable> TableCache::find(const FileMeta &file)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = tables.find(file.number);
+        if (it != tables.end())
+        {
+            hits++;
+            lru.splice(lru.begin(), lru, it->second.lru_it);
+            return it->second.table;
+        }
+        misses++;
+    }
+
+    // Opened without the lock so a slow open does not block lookups of other
+    // tables. If another thread opened the same file meanwhile, its table wins.
+    std::shared_ptr<SSTable> table(SSTable::open(file.filename, options_for(file.number)));
+    if (!table)
+    {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = tables.find(file.number);
+    if (it != tables.end())
+    {
+        lru.splice(lru.begin(), lru, it->second.lru_it);
+        return it->second.table;
+    }
+    add_entry(file.number, table);
+    return table;
+}
+
+void TableCache::insert(const FileMeta &file, std::shared_ptr<SSTable> table)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    remove_entry(file.number);
+    add_entry(file.number, std::move(table));
+}
+
+void TableCache::add_entry(uint64_t number, std::shared_ptr<SSTable> table)
+{
+    while (tables.size() >= capacity)
+    {
+        uint64_t victim = lru.back();
+        LOG_DEBUG("Table cache evicting file %llu", static_cast<unsigned long long>(victim));
+        tables.erase(victim);
+        lru.pop_back();
+    }
+
+    lru.push_front(number);
+    tables[number] = {std::move(table), lru.begin()};
+}
+
+void TableCache::evict(uint64_t number)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    remove_entry(number);
+}
+
+void TableCache::remove_entry(uint64_t number)
+{
+    auto it = tables.find(number);
+    if (it != tables.end())
+    {
+        lru.erase(it->second.lru_it);
+        tables.erase(it);
+    }
+}
+
+size_t TableCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return tables.size();
+}
+
+size_t TableCache::get_hits() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return hits;
+}
+
+size_t TableCache::get_misses() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return misses;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "sstable.h"
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+struct FileMeta
+{
+    uint64_t number;
+    std::string filename;
+    uint64_t file_size;
+    size_t num_entries;
+    // Number of the first file of the sorted run this file belongs to. A
+    // compaction may split its output into several files of one run.
+    uint64_t run;
+    size_t num_tombstones;
+    // Smallest and largest key in the file.
+    std::string smallest;
+    std::string largest;
+};
+
+// LRU cache of opened SSTables (file handle, bloom filter and index),
+// keyed by file number and capped at max_open_files entries. Safe to use
+// from the foreground and background threads at the same time.
+class TableCache
+{
+private:
+    struct Entry
+    {
+        std::shared_ptr<SSTable> table;
+        std::list<uint64_t>::iterator lru_it;
+    };
+
+    size_t capacity;
+    SSTableOptions table_options;
+    std::list<uint64_t> lru;
+    std::unordered_map<uint64_t, Entry> tables;
+    size_t hits;
+    size_t misses;
+    mutable std::mutex mutex;
+
+    void add_entry(uint64_t number, std::shared_ptr<SSTable> table);
+    void remove_entry(uint64_t number);
+
+public:
+    TableCache(size_t max_open_files, const SSTableOptions &options = SSTableOptions());
+    SSTableOptions options_for(uint64_t number) const;
+    std::shared_ptr<SSTable> find(const FileMeta &file);
+    void insert(const FileMeta &file, std::shared_ptr<SSTable> table);
+    void evict(uint64_t number);
+    size_t size() const;
+    size_t get_hits() const;
+    size_t get_misses() const;
+};
@@ -4,6 +4,12 @@
 #include <fstream>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <array>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
 
 #ifndef PLATFORM_APPLE
 #ifndef PLATFORM_LINUX
@@ -25,8 +31,10 @@
 #error "Unknown platform"
 #endif
 
-inline const std::string TOMBSTONE = "__TOMBSTONE__";
-constexpr uint32_t SSTABLE_MAGIC = 0x53535442; // "SSTB"
+constexpr uint32_t SSTABLE_MAGIC = 0x53535442;       // "SSTB"
+constexpr uint32_t SSTABLE_INDEX_MAGIC = 0x53534958; // "SSIX"
+constexpr uint32_t SSTABLE_FOOTER_MAGIC = 0x32545353; // "SST2"
+constexpr uint32_t SSTABLE_FORMAT_VERSION = 9;
 
 #ifdef DEBUG
 #define LOG_INFO(...)        \
@@ -129,3 +137,222 @@ inline uint64_t read_uint64(std::ifstream &file)
     return value;
 #endif
 }
+
+// fsyncs a file, or a directory to make the entries created or renamed in it
+// durable.
+inline bool sync_path(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+#ifdef PLATFORM_APPLE
+    bool ok = fcntl(fd, F_FULLFSYNC) == 0 || ::fsync(fd) == 0;
+#else
+    bool ok = ::fsync(fd) == 0;
+#endif
+    ::close(fd);
+    return ok;
+}
+
+inline uint32_t decode_uint32(const char *ptr)
+{
+#if LSMTREE_LITTLE_ENDIAN
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+#else
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(ptr);
+    return (static_cast<uint32_t>(bytes[0]) |
+            static_cast<uint32_t>(bytes[1]) << 8 |
+            static_cast<uint32_t>(bytes[2]) << 16 |
+            static_cast<uint32_t>(bytes[3]) << 24);
+#endif
+}
+
+inline uint64_t decode_uint64(const char *ptr)
+{
+#if LSMTREE_LITTLE_ENDIAN
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+#else
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(ptr);
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        value |= static_cast<uint64_t>(bytes[i]) << (i * 8);
+    }
+    return value;
+#endif
+}
+
+inline void encode_uint64(char *dst, uint64_t value)
+{
+#if LSMTREE_LITTLE_ENDIAN
+    memcpy(dst, &value, sizeof(value));
+#else
+    for (int i = 0; i < 8; i++)
+    {
+        dst[i] = static_cast<char>((value >> (i * 8)) & 0xFF);
+    }
+#endif
+}
+
+inline void put_uint32(std::string &dst, uint32_t value)
+{
+    char buf[sizeof(value)];
+#if LSMTREE_LITTLE_ENDIAN
+    memcpy(buf, &value, sizeof(value));
+#else
+    for (int i = 0; i < 4; i++)
+    {
+        buf[i] = static_cast<char>((value >> (i * 8)) & 0xFF);
+    }
+#endif
+    dst.append(buf, sizeof(buf));
+}
+
+inline void put_uint64(std::string &dst, uint64_t value)
+{
+    char buf[sizeof(value)];
+#if LSMTREE_LITTLE_ENDIAN
+    memcpy(buf, &value, sizeof(value));
+#else
+    for (int i = 0; i < 8; i++)
+    {
+        buf[i] = static_cast<char>((value >> (i * 8)) & 0xFF);
+    }
+#endif
+    dst.append(buf, sizeof(buf));
+}
+
+// LEB128: seven bits per byte, low bits first.
+inline void put_varint32(std::string &dst, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        dst.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    dst.push_back(static_cast<char>(value));
+}
+
+// Returns the position after the varint, or nullptr if it is truncated or
+// longer than five bytes.
+inline const char *decode_varint32(const char *ptr, const char *limit, uint32_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift <= 28 && ptr < limit; shift += 7)
+    {
+        uint32_t byte = static_cast<unsigned char>(*ptr++);
+        value |= (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return ptr;
+        }
+    }
+    return nullptr;
+}
+
+// Values in the memtable and in SSTables are tagged: one ValueType byte and
+// the sequence number of the write, followed by the user value.
+enum class ValueType : uint8_t
+{
+    Deletion = 0,
+    Value = 1,
+    Merge = 2
+};
+
+constexpr size_t VALUE_TAG_SIZE = 1 + sizeof(uint64_t);
+constexpr uint64_t MAX_SEQUENCE_NUMBER = UINT64_MAX;
+
+// Format 1-3 SSTables stored deletions as this literal value.
+inline const std::string LEGACY_TOMBSTONE = "__TOMBSTONE__";
+
+inline std::string tag_value(ValueType type, uint64_t sequence, std::string_view value = std::string_view())
+{
+    std::string tagged;
+    tagged.reserve(VALUE_TAG_SIZE + value.size());
+    tagged.push_back(static_cast<char>(type));
+    put_uint64(tagged, sequence);
+    tagged.append(value);
+    return tagged;
+}
+
+inline ValueType value_type(std::string_view tagged)
+{
+    return tagged.empty() ? ValueType::Deletion : static_cast<ValueType>(tagged[0]);
+}
+
+inline uint64_t value_sequence(std::string_view tagged)
+{
+    return tagged.size() < VALUE_TAG_SIZE ? 0 : decode_uint64(tagged.data() + 1);
+}
+
+inline std::string_view user_value(std::string_view tagged)
+{
+    return tagged.size() < VALUE_TAG_SIZE ? std::string_view() : tagged.substr(VALUE_TAG_SIZE);
+}
+
+// CRC32C (Castagnoli), table driven.
+inline uint32_t crc32c(const char *data, size_t size, uint32_t crc = 0)
+{
+    static const auto table = []
+    {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int j = 0; j < 8; j++)
+            {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// MurmurHash64A over little-endian words, so hashes stored in files match
+// across platforms.
+inline uint64_t hash64(const char *data, size_t size, uint64_t seed = 0)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+
+    uint64_t h = seed ^ (size * m);
+    const char *end = data + (size & ~size_t(7));
+    for (; data != end; data += 8)
+    {
+        uint64_t k = decode_uint64(data);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    size_t tail = size & 7;
+    if (tail > 0)
+    {
+        for (size_t i = tail; i > 0; i--)
+        {
+            h ^= static_cast<uint64_t>(static_cast<uint8_t>(data[i - 1])) << (8 * (i - 1));
+        }
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
@@ -0,0 +1,236 @@
+#include "wal.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <fstream>
+
+const size_t WAL_RECORD_HEADER_SIZE = sizeof(uint32_t) * 2;
+
+WriteAheadLog::WriteAheadLog(const std::string &fname, WALSyncMode mode)
+    : filename(fname), fd(-1), sync_mode(mode), last_seq(0), synced_seq(0), leader_active(false), failed(false)
+{
+    fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        LOG_ERROR("Cannot open WAL file: %s", filename.c_str());
+    }
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+bool WriteAheadLog::is_open() const
+{
+    return fd >= 0;
+}
+
+const std::string &WriteAheadLog::get_filename() const
+{
+    return filename;
+}
+
+bool WriteAheadLog::write_all(const std::string &data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOG_ERROR("WAL write failed: %s", filename.c_str());
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+bool WriteAheadLog::sync()
+{
+#ifdef PLATFORM_APPLE
+    return fcntl(fd, F_FULLFSYNC) == 0 || ::fsync(fd) == 0;
+#else
+    return ::fdatasync(fd) == 0;
+#endif
+}
+
+bool WriteAheadLog::append(const std::string &payload)
+{
+    uint64_t seq;
+    return add_record(payload, seq) && wait_durable(seq);
+}
+
+bool WriteAheadLog::add_record(const std::string &payload, uint64_t &seq)
+{
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    std::string record;
+    record.reserve(WAL_RECORD_HEADER_SIZE + payload.size());
+    put_uint32(record, crc32c(payload.data(), payload.size()));
+    put_uint32(record, payload.size());
+    record.append(payload);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    seq = ++last_seq;
+    if (sync_mode == WALSyncMode::GroupCommit)
+    {
+        pending.append(record);
+        return true;
+    }
+
+    if (!write_all(record))
+    {
+        failed = true;
+    }
+    return !failed;
+}
+
+bool WriteAheadLog::wait_durable(uint64_t seq)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (sync_mode == WALSyncMode::None)
+    {
+        return !failed;
+    }
+
+    if (sync_mode == WALSyncMode::PerWrite)
+    {
+        if (synced_seq < seq)
+        {
+            uint64_t target = last_seq;
+            failed = failed || !sync();
+            synced_seq = target;
+        }
+        return !failed;
+    }
+
+    while (synced_seq < seq)
+    {
+        if (leader_active)
+        {
+            synced_cv.wait(lock);
+            continue;
+        }
+
+        leader_active = true;
+        std::string batch;
+        batch.swap(pending);
+        uint64_t batch_seq = last_seq;
+
+        lock.unlock();
+        bool ok = write_all(batch) && sync();
+        lock.lock();
+
+        failed = failed || !ok;
+        synced_seq = batch_seq;
+        leader_active = false;
+        synced_cv.notify_all();
+    }
+
+    return !failed;
+}
+
+void WriteAheadLog::encode_op(std::string &payload, WALOpType type, const std::string &key, const std::string &value)
+{
+    payload.push_back(static_cast<char>(type));
+    put_uint32(payload, key.size());
+    payload.append(key);
+    put_uint32(payload, value.size());
+    payload.append(value);
+}
+
+bool WriteAheadLog::decode_ops(std::string_view payload,
+                               const std::function<void(WALOpType, std::string_view, std::string_view)> &fn)
+{
+    size_t pos = 0;
+    while (pos < payload.size())
+    {
+        if (pos + 1 + sizeof(uint32_t) > payload.size())
+        {
+            return false;
+        }
+        WALOpType type = static_cast<WALOpType>(payload[pos]);
+        uint32_t key_size = decode_uint32(&payload[pos + 1]);
+        pos += 1 + sizeof(uint32_t);
+        if (pos + key_size + sizeof(uint32_t) > payload.size())
+        {
+            return false;
+        }
+        std::string_view key = payload.substr(pos, key_size);
+        uint32_t value_size = decode_uint32(&payload[pos + key_size]);
+        pos += key_size + sizeof(uint32_t);
+        if (pos + value_size > payload.size())
+        {
+            return false;
+        }
+        fn(type, key, payload.substr(pos, value_size));
+        pos += value_size;
+    }
+    return true;
+}
+
+bool WriteAheadLog::replay(const std::string &filename, const std::function<void(std::string_view)> &fn)
+{
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        return false;
+    }
+
+    uint64_t file_size = file.tellg();
+    uint64_t offset = 0;
+    file.seekg(0);
+
+    std::string payload;
+    size_t records = 0;
+    bool complete = true;
+    while (offset < file_size)
+    {
+        if (file_size - offset < WAL_RECORD_HEADER_SIZE)
+        {
+            LOG_ERROR("WAL %s: dropping torn record after %zu records", filename.c_str(), records);
+            complete = false;
+            break;
+        }
+
+        uint32_t crc = read_uint32(file);
+        uint32_t length = read_uint32(file);
+        offset += WAL_RECORD_HEADER_SIZE;
+        if (!file || length > file_size - offset)
+        {
+            LOG_ERROR("WAL %s: dropping torn record after %zu records", filename.c_str(), records);
+            complete = false;
+            break;
+        }
+
+        payload.resize(length);
+        file.read(&payload[0], length);
+        if (!file || crc32c(payload.data(), payload.size()) != crc)
+        {
+            LOG_ERROR("WAL %s: dropping torn record after %zu records", filename.c_str(), records);
+            complete = false;
+            break;
+        }
+
+        fn(payload);
+        offset += length;
+        records++;
+    }
+
+    LOG_DEBUG("Replayed %zu records from %s", records, filename.c_str());
+    return complete;
+}
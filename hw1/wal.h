@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+enum class WALSyncMode
+{
+    None,
+    PerWrite,
+    GroupCommit
+};
+
+enum class WALOpType : uint8_t
+{
+    Delete = 0,
+    Put = 1
+};
+
+// Append-only log of framed records: [crc32c u32][length u32][payload].
+// A payload is a sequence of [type u8][key_size u32][key][value_size u32][value].
+// In GroupCommit mode concurrent appenders queue their records and one of
+// them writes and fsyncs the whole queue on behalf of the others.
+// add_record() fixes a record's position in the log; wait_durable() then
+// blocks until it is synced, so callers can order records under their own
+// lock and wait for the disk outside of it.
+class WriteAheadLog
+{
+private:
+    std::string filename;
+    int fd;
+    WALSyncMode sync_mode;
+
+    std::mutex mutex;
+    std::condition_variable synced_cv;
+    std::string pending;
+    uint64_t last_seq;
+    uint64_t synced_seq;
+    bool leader_active;
+    bool failed;
+
+    bool write_all(const std::string &data);
+    bool sync();
+
+public:
+    WriteAheadLog(const std::string &fname, WALSyncMode mode);
+    ~WriteAheadLog();
+    bool is_open() const;
+    bool append(const std::string &payload);
+    bool add_record(const std::string &payload, uint64_t &seq);
+    bool wait_durable(uint64_t seq);
+    const std::string &get_filename() const;
+
+    static void encode_op(std::string &payload, WALOpType type, const std::string &key, const std::string &value);
+    static bool decode_ops(std::string_view payload,
+                           const std::function<void(WALOpType, std::string_view, std::string_view)> &fn);
+    // Calls fn for each intact record in order. Returns false if the file
+    // cannot be read or a damaged record cut the replay short.
+    static bool replay(const std::string &filename, const std::function<void(std::string_view)> &fn);
+};
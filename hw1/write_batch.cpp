@@ -0,0 +1,41 @@
+#include "write_batch.h"
+
+WriteBatch::WriteBatch() : num_ops(0) {}
+
+void WriteBatch::put(const std::string &key, const std::string &value)
+{
+    WriteAheadLog::encode_op(payload, WALOpType::Put, key, value);
+    num_ops++;
+}
+
+void WriteBatch::remove(const std::string &key)
+{
+    WriteAheadLog::encode_op(payload, WALOpType::Delete, key, "");
+    num_ops++;
+}
+
+void WriteBatch::clear()
+{
+    payload.clear();
+    num_ops = 0;
+}
+
+size_t WriteBatch::size() const
+{
+    return num_ops;
+}
+
+size_t WriteBatch::byte_size() const
+{
+    return payload.size();
+}
+
+const std::string &WriteBatch::get_payload() const
+{
+    return payload;
+}
+
+bool WriteBatch::iterate(const std::function<void(WALOpType, std::string_view, std::string_view)> &fn) const
+{
+    return WriteAheadLog::decode_ops(payload, fn);
+}
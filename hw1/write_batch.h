@@ -0,0 +1,27 @@
+#pragma once
+
+#include "wal.h"
+
+#include <string>
+#include <string_view>
+#include <functional>
+
+// Puts and deletes applied to the tree as one unit: a single WAL record, a
+// single memtable pass, and readers see either none or all of it. The
+// contents are kept already encoded as a WAL payload.
+class WriteBatch
+{
+private:
+    std::string payload;
+    size_t num_ops;
+
+public:
+    WriteBatch();
+    void put(const std::string &key, const std::string &value);
+    void remove(const std::string &key);
+    void clear();
+    size_t size() const;
+    size_t byte_size() const;
+    const std::string &get_payload() const;
+    bool iterate(const std::function<void(WALOpType, std::string_view, std::string_view)> &fn) const;
+};